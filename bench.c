@@ -0,0 +1,309 @@
+#if defined(__linux__)
+#define _DEFAULT_SOURCE  /* mkstemps() and clock_gettime() under -std=c11 */
+#endif
+
+/*
+ * Benchmark harness for the grayscale converter (run with "make bench").
+ * It generates synthetic P3 images of a given size in several token
+ * styles, runs the converter binary on each one with every engine a
+ * number of times, and reports throughput and per-image latency. Each
+ * run is a separate process, so the numbers include startup and I/O,
+ * just as a deployment sees them. The output of every engine must match
+ * that of the serial one (or of the first engine run), byte for byte.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define DEFAULT_BINARY "./grayscale"
+#define MAX_RUNS 10000
+
+extern char **environ;
+
+/* Token layouts of the generated pixel data. */
+enum style {
+    STYLE_MINIMAL,  /* single spaces, one row per line */
+    STYLE_PADDED,   /* values right-aligned in 3-wide columns */
+    STYLE_COMMENTS, /* a comment line before every row and after every 16th pixel */
+    STYLE_CRLF,     /* CRLF line ends, lines wrapped at 70 characters */
+    STYLE_COUNT
+};
+
+static const char *const style_names[] = { "minimal", "padded", "comments", "crlf" };
+
+/* Converter configurations compared by the benchmark. */
+enum { ENGINE_SERIAL, ENGINE_SIMD, ENGINE_MMAP, ENGINE_THREADED, ENGINE_COUNT };
+
+static const char *const engine_names[] = { "serial", "simd", "mmap", "threaded" };
+
+static const char *const engine_args[][4] = {
+    { "--no-simd", "--no-mmap", NULL },     /* scalar tokenizer, chunked reads */
+    { "--no-mmap", NULL },                  /* SIMD tokenizer, chunked reads */
+    { NULL },                               /* SIMD tokenizer on the mapped file */
+    { "--threads", "0", NULL },             /* parallel decoder, one thread per CPU */
+};
+
+/* xorshift64*: fast, and the same images for the same seed everywhere. */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static unsigned rng_byte(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned)((rng_state * 0x2545f4914f6cdd1dull) >> 56);
+}
+
+/*
+ * Writes a width x height P3 image with random pixels in the given style.
+ * Returns 0 on a write error.
+ */
+static int generate(FILE *f, int width, int height, int style) {
+    const char *eol = style == STYLE_CRLF ? "\r\n" : "\n";
+    int line = 0;   /* characters on the current line (CRLF wrapping) */
+
+    fprintf(f, "P3%s# synthetic %s image%s%d %d%s255%s", eol, style_names[style], eol,
+            width, height, eol, eol);
+    for (int y = 0; y < height; y++) {
+        if (style == STYLE_COMMENTS) fprintf(f, "# row %d\n", y);
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < 3; c++) {
+                unsigned v = rng_byte();
+                if (style == STYLE_PADDED) {
+                    fprintf(f, "%3u ", v);
+                } else if (style == STYLE_CRLF) {
+                    if (line > 66) {
+                        fputs(eol, f);
+                        line = 0;
+                    }
+                    line += fprintf(f, line ? " %u" : "%u", v);
+                } else {
+                    fprintf(f, x == 0 && c == 0 ? "%u" : " %u", v);
+                }
+            }
+            if (style == STYLE_COMMENTS && x % 16 == 15 && x != width - 1) {
+                fputs(" # next 16 pixels\n", f);
+            }
+        }
+        if (style != STYLE_CRLF) fputs("\n", f);
+    }
+    if (style == STYLE_CRLF && line) fputs(eol, f);
+    return !ferror(f);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Runs "binary [args] in out" with stdout/stderr discarded. Returns its wall time, or -1. */
+static double run_once(const char *binary, const char *const *args, const char *in,
+                       const char *out) {
+    char *argv[16];
+    int argc = 0;
+    posix_spawn_file_actions_t fa;
+    pid_t pid;
+    int status;
+
+    argv[argc++] = (char *)binary;
+    for (int i = 0; args[i]; i++) argv[argc++] = (char *)args[i];
+    argv[argc++] = (char *)in;
+    argv[argc++] = (char *)out;
+    argv[argc] = NULL;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, 2, "/dev/null", O_WRONLY, 0);
+    double t0 = now_seconds();
+    int rc = posix_spawn(&pid, binary, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (rc != 0 || waitpid(pid, &status, 0) != pid) return -1;
+    double t = now_seconds() - t0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? t : -1;
+}
+
+/* FNV-1a hash of the file at path. Returns 0 if it cannot be read. */
+static int hash_file(const char *path, uint64_t *hash) {
+    unsigned char buf[65536];
+    uint64_t h = 0xcbf29ce484222325ull;
+    size_t n;
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) return 0;
+    while ((n = fread(buf, 1, sizeof buf, f)) > 0) {
+        for (size_t i = 0; i < n; i++) h = (h ^ buf[i]) * 0x100000001b3ull;
+    }
+    int ok = !ferror(f);
+    fclose(f);
+    *hash = h;
+    return ok;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of n sorted samples. */
+static double percentile(const double *sorted, int n, int pct) {
+    int rank = (pct * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* Turns a comma-separated list of names into a bitmask. Returns 0 if one is unknown. */
+static unsigned parse_names(const char *list, const char *const *names, int count) {
+    unsigned mask = 0;
+    char buf[256];
+
+    snprintf(buf, sizeof buf, "%s", list);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        int i = 0;
+        while (i < count && strcmp(tok, names[i]) != 0) i++;
+        if (i == count) return 0;
+        mask |= 1u << i;
+    }
+    return mask;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s WxH] [-n RUNS] [--styles LIST] [--engines LIST] [--seed N]\n"
+            "          [--binary PATH]\n"
+            "       %s --generate FILE [-s WxH] [--styles STYLE] [--seed N]\n"
+            "  -s WxH           image size (default 1920x1080)\n"
+            "  -n RUNS          runs per engine and style (default 10)\n"
+            "  --styles LIST    minimal,padded,comments,crlf (default all)\n"
+            "  --engines LIST   serial,simd,mmap,threaded (default all)\n"
+            "  --binary PATH    converter to run (default " DEFAULT_BINARY ")\n"
+            "  --generate FILE  only write one synthetic image to FILE\n",
+            prog, prog);
+}
+
+int main(int argc, char **argv) {
+    int width = 1920, height = 1080, runs = 10;
+    unsigned style_mask = (1u << STYLE_COUNT) - 1, engine_mask = (1u << ENGINE_COUNT) - 1;
+    const char *binary = DEFAULT_BINARY, *generate_to = NULL;
+    static double times[MAX_RUNS];
+    int failed = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "-s") == 0 && val) {
+            if (sscanf(val, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                fprintf(stderr, "Error: Size must be WIDTHxHEIGHT\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "-n") == 0 && val) {
+            runs = atoi(val);
+            if (runs < 1 || runs > MAX_RUNS) {
+                fprintf(stderr, "Error: Runs must be 1-%d\n", MAX_RUNS);
+                return 1;
+            }
+        } else if (strcmp(arg, "--styles") == 0 && val) {
+            if ((style_mask = parse_names(val, style_names, STYLE_COUNT)) == 0) {
+                fprintf(stderr, "Error: Unknown style in '%s'\n", val);
+                return 1;
+            }
+        } else if (strcmp(arg, "--engines") == 0 && val) {
+            if ((engine_mask = parse_names(val, engine_names, ENGINE_COUNT)) == 0) {
+                fprintf(stderr, "Error: Unknown engine in '%s'\n", val);
+                return 1;
+            }
+        } else if (strcmp(arg, "--seed") == 0 && val) {
+            rng_state = strtoull(val, NULL, 0) | 1;
+        } else if (strcmp(arg, "--binary") == 0 && val) {
+            binary = val;
+        } else if (strcmp(arg, "--generate") == 0 && val) {
+            generate_to = val;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (generate_to) {
+        int style = 0;
+        while (!(style_mask & (1u << style))) style++;
+        FILE *f = fopen(generate_to, "wb");
+        if (f == NULL || !generate(f, width, height, style) || fclose(f) != 0) {
+            fprintf(stderr, "Error: Cannot write '%s'\n", generate_to);
+            return 1;
+        }
+        return 0;
+    }
+
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char in_path[4096], out_path[4096];
+    snprintf(out_path, sizeof out_path, "%s/grayscale-bench-out-XXXXXX.ppm", tmp);
+    int out_fd = mkstemps(out_path, 4);
+    if (out_fd < 0) {
+        fprintf(stderr, "Error: Cannot create a file in '%s'\n", tmp);
+        return 1;
+    }
+    close(out_fd);
+
+    printf("%dx%d, %d runs per engine\n", width, height, runs);
+    printf("%-9s %-9s %10s %9s %10s %8s %8s\n",
+           "style", "engine", "input MB", "MB/s", "Mpixel/s", "p50 ms", "p99 ms");
+    for (int style = 0; style < STYLE_COUNT; style++) {
+        if (!(style_mask & (1u << style))) continue;
+
+        snprintf(in_path, sizeof in_path, "%s/grayscale-bench-XXXXXX.ppm", tmp);
+        int fd = mkstemps(in_path, 4);
+        FILE *f = fd < 0 ? NULL : fdopen(fd, "wb");
+        long size = 0;
+        if (f == NULL || !generate(f, width, height, style) || (size = ftell(f)) < 0 ||
+            fclose(f) != 0) {
+            fprintf(stderr, "Error: Cannot write benchmark input in '%s'\n", tmp);
+            failed = 1;
+            break;
+        }
+
+        uint64_t ref_hash = 0;
+        int ref_engine = -1;    /* the engine whose output the others must match */
+        for (int e = 0; e < ENGINE_COUNT; e++) {
+            if (!(engine_mask & (1u << e))) continue;
+            uint64_t hash;
+            int ok = run_once(binary, engine_args[e], in_path, out_path) >= 0 &&  /* warm-up */
+                     hash_file(out_path, &hash);
+            if (ok && ref_engine < 0) {
+                ref_hash = hash;
+                ref_engine = e;
+            } else if (ok && hash != ref_hash) {
+                printf("%-9s %-9s   mismatch (output differs from %s)\n", style_names[style],
+                       engine_names[e], engine_names[ref_engine]);
+                failed = 1;
+                continue;
+            }
+            double total = 0;
+            for (int r = 0; ok && r < runs; r++) {
+                times[r] = run_once(binary, engine_args[e], in_path, out_path);
+                ok = times[r] >= 0;
+                total += times[r];
+            }
+            if (!ok) {
+                printf("%-9s %-9s   failed (is %s built?)\n", style_names[style], engine_names[e],
+                       binary);
+                failed = 1;
+                continue;
+            }
+            qsort(times, (size_t)runs, sizeof times[0], compare_doubles);
+            double mean = total / runs;
+            printf("%-9s %-9s %10.1f %9.1f %10.2f %8.2f %8.2f\n", style_names[style],
+                   engine_names[e], size / 1e6, size / 1e6 / mean,
+                   (double)width * height / 1e6 / mean,
+                   percentile(times, runs, 50) * 1e3, percentile(times, runs, 99) * 1e3);
+        }
+        remove(in_path);
+    }
+    remove(out_path);
+    return failed;
+}
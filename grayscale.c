@@ -1,266 +1,3404 @@
-/*
- * This program converts a color PPM image (P3 format) to grayscale.
- * It is designed to be robust, handling comments and varied whitespace in the PPM header. 
- * It uses buffered I/O and a lookup table for efficient processing.
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <ctype.h>
-
-#define INPUT_FILE "im.ppm"
-#define OUTPUT_FILE "im-gray.ppm"
-#define BUFFER_SIZE (256 * 1024)
-#define MAX_DIMENSION 100000
-
-/* Skips comment lines in a PPM file. A comment line starts with '#' */
-static int skip_comments(FILE *f, int c) {
-    while (c == '#') {
-        /* Skip to end of line */
-        do {
-            c = getc(f);
-            if (c == EOF) return EOF;
-        } while (c != '\n');
-        c = getc(f);  /* Read first char after newline */
-    }
-    return c;
-}
-
-/*
- * Universal integer reading function.
- * Skips whitespace and comments, reads the next unsigned integer.
- * Used for both header parsing and pixel values.
- */
-static int read_uint(FILE *f, int *out, int max_allowed) {
-    int c;
-    int val = 0;
-    int found_digit = 0;
-
-    while (1) {
-        c = getc(f);
-        if (c == EOF) return 0;
-
-        if (c == '#') {
-            /* Found comment, skip to end of line */
-            while ((c = getc(f)) != '\n' && c != EOF);
-        } else if (isspace(c)) {
-            /* Continue skipping whitespace */
-            continue;
-        } else {
-            /* Found non-whitespace, non-comment character - ready to parse */
-            break;
-        }
-    }
-
-    if (!isdigit(c)) {
-        /* First valid character is not a digit - invalid format */
-        ungetc(c, f);
-        return 0;
-    }
-
-    /* Parse the integer */
-    do {
-        found_digit = 1;
-        int digit = c - '0';
-
-        /* Check for overflow before multiplying */
-        if (val > (max_allowed / 10) + 1) {
-            val = max_allowed + 1; /* Mark as overflow */
-        } else {
-            val = val * 10 + digit;
-        }
-
-        c = getc(f);
-    } while (isdigit(c));
-
-    /* Put back the non-digit character to avoid consuming delimiters */
-    if (c != EOF) {
-        ungetc(c, f);
-    }
-
-    if (!found_digit || val > max_allowed) {
-        return 0;
-    }
-
-    *out = val;
-    return 1;
-}
-
-int main(void) {
-    FILE *input_file = NULL, *output_file = NULL;
-    char magic[3], *in_buf = NULL, *out_buf = NULL, *row_buf = NULL;
-    int width, height, max_val;
-    int ret = 1;
-
-    /* LUT: textual representations of 0..255 and their byte lengths. */
-    char num_text[256][4];    /* "0".."255" + NUL; copied via memcpy without NUL */
-    uint8_t num_len[256];
-
-    /* Open input file in binary mode. */
-    if ((input_file = fopen(INPUT_FILE, "rb")) == NULL) {
-        fprintf(stderr, "Error: Cannot open input file '%s'\n", INPUT_FILE);
-        return 1;
-    }
-    /* Attach input buffer for efficient reading */
-    if ((in_buf = malloc(BUFFER_SIZE)) != NULL) {
-        setvbuf(input_file, in_buf, _IOFBF, BUFFER_SIZE);
-    }
-
-    /* Parse and validate header - skip any comments.
-     * Using isspace() for consistent whitespace handling across all parsing. */
-    int c;
-    do {
-        c = getc(input_file);
-        if (c == EOF) {
-            fprintf(stderr, "Error: Unexpected EOF in header\n");
-            goto cleanup;
-        }
-        c = skip_comments(input_file, c);
-    } while (isspace(c));
-    ungetc(c, input_file);
-    
-    if (fscanf(input_file, "%2s", magic) != 1 || strcmp(magic, "P3") != 0) {
-        fprintf(stderr, "Error: Unsupported PPM magic number (expected P3)\n");
-        goto cleanup;
-    }
-    
-    /* Read width and height with comment support.
-     * Replaced fscanf with read_uint to properly handle inline comments
-     * like "2000 # width". fscanf fails on such inputs because it doesn't skip '#'. */
-    if (!read_uint(input_file, &width, MAX_DIMENSION) ||
-        !read_uint(input_file, &height, MAX_DIMENSION)) {
-        fprintf(stderr, "Error: Failed to read image dimensions\n");
-        goto cleanup;
-    }
-    if (width <= 0 || height <= 0 || width > MAX_DIMENSION || height > MAX_DIMENSION) {
-        fprintf(stderr, "Error: Invalid image dimensions (%dx%d), must be 1-%d\n", 
-                width, height, MAX_DIMENSION);
-        goto cleanup;
-    }
-    
-    /* Check for potential overflow in pixel count */
-    if ((long long)width * height > (long long)MAX_DIMENSION * MAX_DIMENSION / 10) {
-        fprintf(stderr, "Error: Image too large (%dx%d pixels)\n", width, height);
-        goto cleanup;
-    }
-    
-    /* Read max value with comment support */
-    if (!read_uint(input_file, &max_val, 65535)) {
-        fprintf(stderr, "Error: Failed to read maximum color value\n");
-        goto cleanup;
-    }
-    if (max_val != 255) {
-        /*
-         * This implementation only supports a maximum color value of 255.
-         */
-        fprintf(stderr, "Error: Maximum color value must be 255 (got %d)\n", max_val);
-        goto cleanup;
-    }
-
-    if ((output_file = fopen(OUTPUT_FILE, "wb")) == NULL) {
-        fprintf(stderr, "Error: Cannot open output file '%s'\n", OUTPUT_FILE);
-        goto cleanup;
-    }
-    /* Attach output buffer for efficient writing */
-    if ((out_buf = malloc(BUFFER_SIZE)) != NULL) {
-        setvbuf(output_file, out_buf, _IOFBF, BUFFER_SIZE);
-    }
-
-    if (fprintf(output_file, "P3\n%d %d\n%d\n", width, height, max_val) < 0) {
-        fprintf(stderr, "Error: Failed to write output header\n");
-        goto cleanup;
-    }
-
-    /*
-     * Pre-generate string representations for numbers 0-255 to avoid repeated snprintf calls in the main loop, which improves performance
-     */
-    for (int v = 0; v <= 255; v++) {
-        int n = snprintf(num_text[v], sizeof num_text[v], "%d", v);
-        if (n <= 0) n = 1; /* should not happen */
-        num_len[v] = (uint8_t)n;
-    }
-
-    /* Allocate row buffer for one-write-per-row output */
-    size_t row_cap = (size_t)width * (3 * 3 + 3) + 2;  /* Conservative estimate */
-    if ((row_buf = malloc(row_cap)) == NULL) {
-        fprintf(stderr, "Error: Cannot allocate row buffer (%zu bytes)\n", row_cap);
-        goto cleanup;
-    }
-
-    /* Main loop: build each row and write once */
-    for (int y = 0; y < height; y++) {
-        size_t pos = 0;  /* Current position in row buffer */
-        
-        for (int x = 0; x < width; x++) {
-            /* Read RGB pixel values */
-            int r, g, b;
-            if (!read_uint(input_file, &r, 255) || 
-                !read_uint(input_file, &g, 255) || 
-                !read_uint(input_file, &b, 255)) {
-                fprintf(stderr, "Error: Failed to read pixel data at row %d, col %d\n", y, x);
-                goto cleanup;
-            }
-            
-            /* Validate pixel values are in valid range */
-            if ((unsigned)r > 255u || (unsigned)g > 255u || (unsigned)b > 255u) {
-                fprintf(stderr, "Error: Pixel value out of range at row %d, col %d\n", y, x);
-                goto cleanup;
-            }
-            
-            /* Calculate grayscale value (simple average) */
-            int gray = (r + g + b) / 3;
-
-            /* Append grayscale triplet to the row buffer */
-            memcpy(row_buf + pos, num_text[gray], num_len[gray]);
-            pos += num_len[gray];
-            row_buf[pos++] = ' ';
-            
-            memcpy(row_buf + pos, num_text[gray], num_len[gray]);
-            pos += num_len[gray];
-            row_buf[pos++] = ' ';
-            
-            memcpy(row_buf + pos, num_text[gray], num_len[gray]);
-            pos += num_len[gray];
-            
-            /* Add space between pixels (except last pixel in row) */
-            if (x != width - 1) {
-                row_buf[pos++] = ' ';
-            }
-        }
-        
-        /* Add newline at end of row */
-        row_buf[pos++] = '\n';
-        
-        /*Write the row.*/
-        if (fwrite(row_buf, 1, pos, output_file) != pos) {
-            fprintf(stderr, "Error: Write failure at row %d\n", y);
-            goto cleanup;
-        }
-    }
-    
-    ret = 0;
-
-cleanup:
-    /* Clean up resources */
-    if (input_file && fclose(input_file) != 0 && ret == 0) {
-        fprintf(stderr, "Warning: Error closing input file\n");
-        ret = 1;
-    }
-    if (output_file) {
-        if (fclose(output_file) != 0 && ret == 0) {
-            fprintf(stderr, "Error: Failed to close output file properly\n");
-            ret = 1;
-        }
-        if (ret != 0) {
-            remove(OUTPUT_FILE);  /* Clean up partial output on error */
-        }
-    }
-
-    free(in_buf);
-    free(out_buf);
-    free(row_buf);
-    return ret;
-}
-
+#if defined(__linux__)
+#define _GNU_SOURCE  /* fileno(), mmap(), sysconf() and vmsplice() under -std=c11 */
+#endif
+
+/*
+ * This program converts a color PPM image (P3 or P6 format) to grayscale.
+ * It is designed to be robust, handling comments and varied whitespace in the PPM header. 
+ * It uses buffered I/O and a lookup table for efficient processing.
+ * Decoding, conversion and encoding live in libgrayscale.c; this file is
+ * the command-line front end (file handling, threading and batch mode).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "libgrayscale.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#define HAVE_MMAP 1
+#define HAVE_DIRENT 1
+#define HAVE_WRITEV 1
+#define HAVE_INDEX 1
+#define HAVE_PREAD 1
+#if defined(__APPLE__)
+#define MTIME_NSEC(s) ((s).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(s) ((s).st_mtim.tv_nsec)
+#endif
+#endif
+
+#if defined(__linux__) && defined(SPLICE_F_GIFT)
+#define HAVE_VMSPLICE 1
+#endif
+
+#if defined(__linux__)
+#define HAVE_FALLOCATE 1
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__) || defined(__MINGW32__)
+#include <pthread.h>
+#define HAVE_PTHREAD 1
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_PTHREAD)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#define HAVE_SERVE 1
+#endif
+
+#define INPUT_FILE "im.ppm"
+#define OUTPUT_FILE "im-gray.ppm"
+#define BUFFER_SIZE (256 * 1024)
+#define MAX_THREADS 256
+#define SLICE_MIN_BYTES (64 * 1024)     /* don't split the input finer than this */
+#define BAND_TARGET_BYTES (1024 * 1024) /* output bytes encoded per worker per band */
+#define PIPE_SLOTS 4                    /* chunks in flight between --pipeline stages */
+#define SINK_BATCH_BYTES (256 * 1024)   /* rows gathered per writev() */
+#define STRIP_TARGET_BYTES (512 * 1024) /* input bytes per strip of the parallel P6 loop */
+#define SINK_MAX_IOV 1024
+#define TILE_PIXELS (64 * 1024)         /* wider rows are streamed in tiles this wide */
+#define ARENA_ALIGN 64
+#define ARENA_GRANULE (2u * 1024 * 1024)  /* arena sizes are multiples of a huge page */
+#define ARENA_DEFAULT_MAX 64            /* --arena-max default, in MiB */
+#define SERVE_LINE_MAX 4096             /* longest --serve request line */
+#define SERVE_MAX_FDS 16                /* descriptors queued on one --serve connection */
+#define CHECKPOINT_BYTES (64ull << 20)  /* output written between --checkpoint saves */
+
+/* Batch mode: input being converted by this thread, used to label messages. */
+static _Thread_local const char *current_input;
+
+/* --serve: if set, the first message of the current request is kept here for the reply. */
+static _Thread_local char *first_error;
+
+/*
+ * Prints an error to stderr, prefixed with the current input name in
+ * batch mode. One fputs per message keeps concurrent workers' lines whole.
+ */
+static void report_error(const char *fmt, ...) {
+    char msg[1024];
+    size_t n = 0;
+    va_list ap;
+
+    if (current_input) {
+        int k = snprintf(msg, sizeof msg, "%s: ", current_input);
+        n = k < 0 ? 0 : (size_t)k < sizeof msg ? (size_t)k : sizeof msg - 1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(msg + n, sizeof msg - n, fmt, ap);
+    va_end(ap);
+    fputs(msg, stderr);
+    if (first_error && first_error[0] == '\0') {
+        memcpy(first_error, msg + n, strlen(msg + n) + 1);  /* both are sizeof msg */
+    }
+}
+
+/*
+ * --stats: time per phase and data moved, summed over the images of a run.
+ * The phases are timed only when this is enabled (the row loops then split
+ * gs_encode_row() into its convert and encode halves); the decoder's own
+ * counters are kept per chunk and per row in any case.
+ */
+struct stats {
+    double open, header, decode, convert, encode, write;  /* seconds */
+    uint64_t images, failed, rows;
+    uint64_t bytes_in, bytes_out;
+    uint64_t values, comment_bytes, read_calls;
+    uint64_t arena_peak;    /* most arena memory one image took (a maximum, not a sum) */
+};
+
+static double stats_now(void) {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Adds the time since *t to *phase and restarts *t. */
+static void lap(double *phase, double *t) {
+    double now = stats_now();
+    *phase += now - *t;
+    *t = now;
+}
+
+static void stats_add(struct stats *to, const struct stats *from) {
+    to->open += from->open;
+    to->header += from->header;
+    to->decode += from->decode;
+    to->convert += from->convert;
+    to->encode += from->encode;
+    to->write += from->write;
+    to->images += from->images;
+    to->failed += from->failed;
+    to->rows += from->rows;
+    to->bytes_in += from->bytes_in;
+    to->bytes_out += from->bytes_out;
+    to->values += from->values;
+    to->comment_bytes += from->comment_bytes;
+    to->read_calls += from->read_calls;
+    if (from->arena_peak > to->arena_peak) to->arena_peak = from->arena_peak;
+}
+
+/*
+ * Read and write system calls made by the process so far, from
+ * /proc/self/io on Linux. Returns 0 where they are not available.
+ */
+static int io_syscalls(uint64_t *reads, uint64_t *writes) {
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/io", "r");
+    char line[128];
+    int found = 0;
+    unsigned long long v;
+
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "syscr: %llu", &v) == 1) {
+            *reads = v;
+            found |= 1;
+        } else if (sscanf(line, "syscw: %llu", &v) == 1) {
+            *writes = v;
+            found |= 2;
+        }
+    }
+    fclose(f);
+    return found == 3;
+#else
+    (void)reads;
+    (void)writes;
+    return 0;
+#endif
+}
+
+/* Peak resident set size of the process in bytes, or -1 where unknown. */
+static long long peak_rss(void) {
+#ifdef HAVE_MMAP
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return -1;
+#if defined(__APPLE__)
+    return (long long)ru.ru_maxrss;         /* bytes */
+#else
+    return (long long)ru.ru_maxrss * 1024;  /* kilobytes */
+#endif
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Prints the run's stats to stderr, as a table or as one JSON object on a
+ * single line (any other stream, stdout included, may carry the image).
+ * total is wall time; the phases of a batch are summed over its workers.
+ * Syscall counts and a peak RSS of -1 mean unknown.
+ */
+static void print_stats(const struct stats *st, double total, long long sys_reads,
+                        long long sys_writes, long long rss, int json) {
+    if (json) {
+        fprintf(stderr,
+                "{\"images\":%llu,\"failed\":%llu,\"rows\":%llu,\"bytes_in\":%llu,"
+                "\"bytes_out\":%llu,\"values\":%llu,\"comment_bytes\":%llu,"
+                "\"read_calls\":%llu,\"syscalls_read\":%lld,\"syscalls_write\":%lld,"
+                "\"arena_peak_bytes\":%llu,\"peak_rss_bytes\":%lld,"
+                "\"open_ms\":%.3f,\"header_ms\":%.3f,\"decode_ms\":%.3f,"
+                "\"convert_ms\":%.3f,\"encode_ms\":%.3f,\"write_ms\":%.3f,"
+                "\"total_ms\":%.3f}\n",
+                (unsigned long long)st->images, (unsigned long long)st->failed,
+                (unsigned long long)st->rows, (unsigned long long)st->bytes_in,
+                (unsigned long long)st->bytes_out, (unsigned long long)st->values,
+                (unsigned long long)st->comment_bytes, (unsigned long long)st->read_calls,
+                sys_reads, sys_writes, (unsigned long long)st->arena_peak, rss,
+                st->open * 1e3, st->header * 1e3, st->decode * 1e3, st->convert * 1e3,
+                st->encode * 1e3, st->write * 1e3, total * 1e3);
+        return;
+    }
+    fprintf(stderr,
+            "images         %llu (%llu failed)\n"
+            "rows           %llu\n"
+            "bytes in       %llu\n"
+            "bytes out      %llu\n"
+            "values         %llu\n"
+            "comment bytes  %llu\n"
+            "read calls     %llu\n",
+            (unsigned long long)st->images, (unsigned long long)st->failed,
+            (unsigned long long)st->rows, (unsigned long long)st->bytes_in,
+            (unsigned long long)st->bytes_out, (unsigned long long)st->values,
+            (unsigned long long)st->comment_bytes, (unsigned long long)st->read_calls);
+    if (sys_reads >= 0) {
+        fprintf(stderr, "syscalls       %lld read, %lld write\n", sys_reads, sys_writes);
+    }
+    fprintf(stderr, "arena peak     %llu bytes\n", (unsigned long long)st->arena_peak);
+    if (rss >= 0) fprintf(stderr, "peak RSS       %lld bytes\n", rss);
+    fprintf(stderr,
+            "open           %10.3f ms\n"
+            "header         %10.3f ms\n"
+            "decode         %10.3f ms\n"
+            "convert        %10.3f ms\n"
+            "encode         %10.3f ms\n"
+            "write          %10.3f ms\n"
+            "total          %10.3f ms\n",
+            st->open * 1e3, st->header * 1e3, st->decode * 1e3, st->convert * 1e3,
+            st->encode * 1e3, st->write * 1e3, total * 1e3);
+}
+
+/* Read-only mapping of a whole input file. data is NULL when not mapped. */
+struct input_map {
+    unsigned char *data;
+    size_t size;
+};
+
+/*
+ * Maps the file behind f if it is a non-empty regular file. Pipes, ttys and
+ * systems without mmap() return 0 and keep using the buffered FILE* path.
+ */
+static int map_input(FILE *f, struct input_map *m) {
+    m->data = NULL;
+    m->size = 0;
+#ifdef HAVE_MMAP
+    struct stat st;
+    int fd = fileno(f);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        (unsigned long long)st.st_size > SIZE_MAX) {
+        return 0;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return 0;
+    /* Hints only; failures are harmless */
+    posix_madvise(p, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(p, (size_t)st.st_size, MADV_HUGEPAGE);
+#endif
+    m->data = p;
+    m->size = (size_t)st.st_size;
+    return 1;
+#else
+    (void)f;
+    return 0;
+#endif
+}
+
+static void unmap_input(struct input_map *m) {
+#ifdef HAVE_MMAP
+    if (m->data) munmap(m->data, m->size);
+#endif
+    m->data = NULL;
+}
+
+/*
+ * Reads the rest of f into one malloc'd block (for inputs that cannot be
+ * mapped), after the head bytes the decoder already holds. Returns NULL
+ * on allocation or read failure.
+ */
+static unsigned char *read_all(FILE *f, const unsigned char *head, size_t head_len,
+                               size_t *len) {
+    size_t cap = head_len + BUFFER_SIZE, n = head_len;
+    unsigned char *buf = malloc(cap);
+
+    if (buf) memcpy(buf, head, head_len);
+    while (buf) {
+        n += fread(buf + n, 1, cap - n, f);
+        if (n < cap) break;
+        unsigned char *grown = cap <= SIZE_MAX / 2 ? realloc(buf, cap * 2) : NULL;
+        if (grown == NULL) {
+            free(buf);
+            return NULL;
+        }
+        buf = grown;
+        cap *= 2;
+    }
+    if (buf && ferror(f)) {
+        free(buf);
+        return NULL;
+    }
+    *len = n;
+    return buf;
+}
+
+/*
+ * Per-worker arena for the buffers of one image. Blocks are carved off its
+ * front and arena_reset() takes them all back before the next image, so a
+ * batch reuses the same memory, already faulted in, instead of going
+ * through malloc() and free() for every image. A block that does not fit
+ * comes from malloc() and is freed by the reset, which then grows the
+ * arena to what the image took, but never past the high-water mark limit
+ * (--arena-max); bigger images spill the rest. The arena is an anonymous
+ * mapping with huge pages where available, prefaulted when it is made.
+ */
+struct arena {
+    unsigned char *base;
+    size_t size, used;
+    size_t demand;          /* bytes asked for since the last reset */
+    size_t limit;           /* most the arena grows to */
+    void *spills;           /* chain of the malloc()'d blocks */
+};
+
+/* Makes a's memory size bytes (a multiple of ARENA_GRANULE). Returns 0 on failure. */
+static int arena_map(struct arena *a, size_t size) {
+#ifdef HAVE_MMAP
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);  /* before the first touch, which picks the page size */
+#endif
+#else
+    void *p = malloc(size);
+    if (p == NULL) return 0;
+#endif
+    for (size_t off = 0; off < size; off += 4096) ((volatile unsigned char *)p)[off] = 0;
+    a->base = p;
+    a->size = size;
+    return 1;
+}
+
+static void arena_unmap(struct arena *a) {
+#ifdef HAVE_MMAP
+    if (a->base) munmap(a->base, a->size);
+#else
+    free(a->base);
+#endif
+    a->base = NULL;
+    a->size = 0;
+}
+
+/* An empty arena of at most limit bytes; it is mapped on first use. */
+static void arena_init(struct arena *a, size_t limit) {
+    memset(a, 0, sizeof *a);
+    a->limit = limit / ARENA_GRANULE * ARENA_GRANULE;
+}
+
+/* n bytes, ARENA_ALIGN-aligned within the arena. Returns NULL on allocation failure. */
+static void *arena_alloc(struct arena *a, size_t n) {
+    if (n > SIZE_MAX / 2) return NULL;
+    size_t need = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->demand = need <= SIZE_MAX - a->demand ? a->demand + need : SIZE_MAX;
+    if (a->base == NULL && a->limit > 0) arena_map(a, ARENA_GRANULE);
+    if (a->base && need <= a->size - a->used) {
+        void *p = a->base + a->used;
+        a->used += need;
+        return p;
+    }
+    void **spill = malloc(ARENA_ALIGN + need);
+    if (spill == NULL) return NULL;
+    *spill = a->spills;
+    a->spills = spill;
+    return (unsigned char *)spill + ARENA_ALIGN;
+}
+
+/* Takes back every block, growing the arena if the last image did not fit. */
+static void arena_reset(struct arena *a) {
+    while (a->spills) {
+        void *next = *(void **)a->spills;
+        free(a->spills);
+        a->spills = next;
+    }
+    size_t want = a->demand > a->limit ? a->limit
+                  : (a->demand + ARENA_GRANULE - 1) / ARENA_GRANULE * ARENA_GRANULE;
+    if (want > a->size) {
+        arena_unmap(a);
+        arena_map(a, want);  /* on failure blocks come from malloc() */
+    }
+    a->used = 0;
+    a->demand = 0;
+}
+
+static void arena_free(struct arena *a) {
+    a->demand = 0;  /* no growth */
+    arena_reset(a);
+    arena_unmap(a);
+}
+
+#ifdef HAVE_INDEX
+/*
+ * Sidecar index for --index, INPUT.gsidx next to the input. It records the
+ * header fields, where the pixel data starts and, for P3, the byte offset
+ * of every row, as captured by a complete single-threaded decode. Later
+ * runs skip the header, seek straight to the first row of a --crop and
+ * split --threads work at row boundaries without scanning for them. The
+ * file is native-endian and only trusted while the input's size and mtime
+ * are the ones recorded in it.
+ */
+#define INDEX_MAGIC "GSIDX1\n"
+#define INDEX_SUFFIX ".gsidx"
+
+struct index_head {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_sec, mtime_nsec;
+    int32_t format, width, height, maxval;
+    uint64_t data_offset;   /* first pixel byte */
+    uint64_t nrows;         /* row offsets that follow: height + 1 for P3, else 0 */
+};
+
+/* An input's index. rows[height] is the end of the pixel data. */
+struct row_index {
+    struct index_head head;
+    uint64_t *rows;         /* P3 only; P6 rows are at fixed strides */
+};
+
+/* Byte offset of the start of row y in the input. */
+static uint64_t index_row_offset(const struct row_index *ix, int y) {
+    const struct index_head *h = &ix->head;
+    if (ix->rows) return ix->rows[y];
+    return h->data_offset + (uint64_t)y * (uint64_t)h->width * (h->maxval > 255 ? 6 : 3);
+}
+
+static void index_free(struct row_index *ix) {
+    free(ix->rows);
+    memset(ix, 0, sizeof *ix);
+}
+
+/*
+ * Loads the index of in_path, open as f. Returns 1 if it is valid for the
+ * input as it is now, 0 if there is none (or a stale one), and -1 if f is
+ * not a regular file. Unless -1, ix->head identifies the input for a
+ * later index_save().
+ */
+static int index_load(const char *in_path, FILE *f, struct row_index *ix) {
+    char path[4096];
+    struct index_head h, now;
+    struct stat st;
+    FILE *idx;
+    int ok = 0;
+
+    memset(ix, 0, sizeof *ix);
+    memset(&now, 0, sizeof now);
+    if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    memcpy(now.magic, INDEX_MAGIC, sizeof now.magic);
+    now.file_size = (uint64_t)st.st_size;
+    now.mtime_sec = (int64_t)st.st_mtime;
+    now.mtime_nsec = (int64_t)MTIME_NSEC(st);
+    ix->head = now;
+    if (snprintf(path, sizeof path, "%s" INDEX_SUFFIX, in_path) >= (int)sizeof path ||
+        (idx = fopen(path, "rb")) == NULL) {
+        return 0;
+    }
+    if (fread(&h, sizeof h, 1, idx) == 1 &&
+        memcmp(h.magic, INDEX_MAGIC, sizeof h.magic) == 0 &&
+        h.file_size == now.file_size && h.mtime_sec == now.mtime_sec &&
+        h.mtime_nsec == now.mtime_nsec &&
+        (h.format == GS_FMT_P3 || h.format == GS_FMT_P6) &&
+        h.width >= 1 && h.width <= GS_MAX_DIMENSION &&
+        h.height >= 1 && h.height <= GS_MAX_DIMENSION &&
+        h.maxval >= 1 && h.maxval <= GS_MAX_MAXVAL &&
+        h.nrows == (h.format == GS_FMT_P3 ? (uint64_t)h.height + 1 : 0) &&
+        h.nrows <= SIZE_MAX / sizeof *ix->rows) {
+        ix->head = h;
+        ok = 1;
+        if (h.nrows && ((ix->rows = malloc((size_t)h.nrows * sizeof *ix->rows)) == NULL ||
+                        fread(ix->rows, sizeof *ix->rows, (size_t)h.nrows, idx) != h.nrows)) {
+            ok = 0;
+        }
+        /* Rows start in order, after the header and within the file */
+        for (uint64_t y = 1; ok && y < h.nrows; y++) ok = ix->rows[y] > ix->rows[y - 1];
+        ok = ok && index_row_offset(ix, 0) == h.data_offset &&
+             index_row_offset(ix, h.height) <= h.file_size;
+    }
+    fclose(idx);
+    if (!ok) {
+        index_free(ix);
+        ix->head = now;
+    }
+    return ok;
+}
+
+/*
+ * Writes ix as the index of in_path, replacing any old one atomically. An
+ * index is only a shortcut, so failures are silently ignored.
+ */
+static void index_save(const char *in_path, const struct row_index *ix) {
+    char path[4096], tmp[4200];
+    FILE *out;
+
+    if (snprintf(path, sizeof path, "%s" INDEX_SUFFIX, in_path) >= (int)sizeof path) return;
+    snprintf(tmp, sizeof tmp, "%s.%ld.tmp", path, (long)getpid());
+    if ((out = fopen(tmp, "wb")) == NULL) return;
+    size_t n = (size_t)ix->head.nrows;
+    int ok = fwrite(&ix->head, sizeof ix->head, 1, out) == 1 &&
+             (n == 0 || fwrite(ix->rows, sizeof *ix->rows, n, out) == n);
+    if (fclose(out) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) remove(tmp);
+}
+
+/*
+ * Checkpoint for --checkpoint, OUTPUT.gsck next to the output. Every
+ * CHECKPOINT_BYTES of output, the rows written so far are flushed to disk
+ * and the checkpoint records how many there are, where the next one starts
+ * in the input and where its output goes. A failed run keeps that much of
+ * its output. The next run with the same input and settings seeks to the
+ * recorded offsets, writes the remaining rows in place and removes the
+ * checkpoint once the image is complete.
+ */
+#define CHECKPOINT_MAGIC "GSCKP1\n"
+#define CHECKPOINT_SUFFIX ".gsck"
+
+struct checkpoint {
+    char magic[8];
+    uint64_t file_size;             /* the input, as for an index */
+    int64_t mtime_sec, mtime_nsec;
+    int32_t format, width, height, maxval;
+    int32_t out_format, reserved;
+    uint64_t settings;              /* FNV-1a of the conversion tables */
+    uint64_t rows;                  /* rows completed */
+    uint64_t in_offset;             /* input offset of the next row */
+    uint64_t out_offset;            /* output offset of the next row */
+};
+
+/*
+ * Hashes the weights and tables that decide the gray values, so other
+ * settings start over. gs_converter_init() zeroes the tables a mode does
+ * not use, so the key does not depend on an earlier set-up of conv.
+ */
+static uint64_t checkpoint_settings(const struct gs_converter *conv) {
+    const unsigned char *p = (const unsigned char *)&conv->wr;
+    const unsigned char *end = (const unsigned char *)(conv->tone_curve + sizeof conv->tone_curve);
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    for (; p < end; p++) h = (h ^ *p) * 0x100000001b3ull;
+    return h;
+}
+
+/*
+ * Loads the checkpoint of out_path for the input open as f, converted
+ * with conv to out_format. Returns 1 if it is valid
+ * for the input, the settings and the output as they are now, 0 if there
+ * is none (ck then identifies a fresh run), and -1 if f is not a regular
+ * file.
+ */
+static int checkpoint_load(const char *out_path, FILE *f, const struct gs_converter *conv,
+                           int out_format, struct checkpoint *ck) {
+    char path[4096];
+    struct checkpoint c;
+    struct stat st, out_st;
+    FILE *in;
+    int ok = 0;
+
+    memset(ck, 0, sizeof *ck);
+    if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    memcpy(ck->magic, CHECKPOINT_MAGIC, sizeof ck->magic);
+    ck->file_size = (uint64_t)st.st_size;
+    ck->mtime_sec = (int64_t)st.st_mtime;
+    ck->mtime_nsec = (int64_t)MTIME_NSEC(st);
+    ck->out_format = out_format;
+    ck->settings = checkpoint_settings(conv);
+    if (snprintf(path, sizeof path, "%s" CHECKPOINT_SUFFIX, out_path) >= (int)sizeof path ||
+        (in = fopen(path, "rb")) == NULL) {
+        return 0;
+    }
+    /* Only 8-bit rows of the plain row loop are checkpointed */
+    if (fread(&c, sizeof c, 1, in) == 1 &&
+        memcmp(c.magic, CHECKPOINT_MAGIC, sizeof c.magic) == 0 &&
+        c.file_size == ck->file_size && c.mtime_sec == ck->mtime_sec &&
+        c.mtime_nsec == ck->mtime_nsec && c.out_format == ck->out_format &&
+        c.settings == ck->settings &&
+        (c.format == GS_FMT_P3 || c.format == GS_FMT_P6) &&
+        c.width >= 1 && c.width <= TILE_PIXELS && c.height >= 1 &&
+        c.height <= GS_MAX_DIMENSION && c.maxval == 255 &&
+        c.rows >= 1 && c.rows < (uint64_t)c.height && c.in_offset <= c.file_size &&
+        stat(out_path, &out_st) == 0 && S_ISREG(out_st.st_mode) &&
+        (uint64_t)out_st.st_size >= c.out_offset) {
+        *ck = c;
+        ok = 1;
+    }
+    fclose(in);
+    return ok;
+}
+
+/*
+ * Flushes out to disk up to out_offset and records the decoder's position
+ * as the checkpoint of out_path. Returns 0 if the output cannot be
+ * flushed; a checkpoint that cannot be written leaves the previous one,
+ * which is still valid, so that is ignored.
+ */
+static int checkpoint_save(FILE *out, const char *out_path, struct checkpoint *ck,
+                           uint64_t rows, uint64_t in_offset, uint64_t out_offset) {
+    char path[4096], tmp[4200];
+    FILE *f;
+
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0) return 0;
+    ck->rows = rows;
+    ck->in_offset = in_offset;
+    ck->out_offset = out_offset;
+    if (snprintf(path, sizeof path, "%s" CHECKPOINT_SUFFIX, out_path) >= (int)sizeof path) {
+        return 1;
+    }
+    snprintf(tmp, sizeof tmp, "%s.%ld.tmp", path, (long)getpid());
+    if ((f = fopen(tmp, "wb")) == NULL) return 1;
+    int ok = fwrite(ck, sizeof *ck, 1, f) == 1;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) remove(tmp);
+    return 1;
+}
+
+static void checkpoint_remove(const char *out_path) {
+    char path[4096];
+    if (snprintf(path, sizeof path, "%s" CHECKPOINT_SUFFIX, out_path) < (int)sizeof path) {
+        remove(path);
+    }
+}
+#endif
+
+/* Output backends of the single-threaded row loop (--output-io). */
+enum output_io {
+    OUT_STDIO,      /* fwrite() through the stdio buffer */
+    OUT_WRITEV,     /* rows gathered and written with one writev() */
+    OUT_VMSPLICE,   /* rows spliced into a stdout pipe without a copy */
+    OUT_MMAP,       /* binary rows encoded straight into the mapped output file */
+    OUT_AUTO        /* mmap where possible, else writev */
+};
+
+#ifdef HAVE_WRITEV
+/*
+ * Row sink for the fd-level backends. writev and vmsplice hand out one
+ * row_cap slot per row in a slab and write a whole slab of rows per call;
+ * mmap hands out the row's place in the output file itself. The stdio
+ * buffer is flushed before the sink takes over and is not used again.
+ */
+struct row_sink {
+    int kind;               /* OUT_WRITEV, OUT_VMSPLICE or OUT_MMAP */
+    int fd;
+    size_t row_cap;
+    char *slab[2];          /* vmsplice alternates between two */
+    size_t slab_size;
+    int cur, nrows, batch_rows;
+    struct iovec iov[SINK_MAX_IOV];
+    char *map;              /* OUT_MMAP */
+    size_t map_size, map_pos;
+    int first_row;          /* first row not yet written, for error messages */
+};
+
+/* Anonymous pages: spliced pages must never go back to malloc while still in the pipe. */
+static char *sink_alloc(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Sets up a sink for an output that already holds start bytes (the
+ * header). A backend that does not fit the output falls back to writev:
+ * mmap needs a regular file and a binary format (so the size is known),
+ * vmsplice a pipe. Returns 0 if nothing could be set up.
+ */
+static int sink_open(struct row_sink *s, FILE *f, int kind, int can_map, int format,
+                     int height, size_t row_cap, size_t start) {
+    struct stat st;
+
+    memset(s, 0, sizeof *s);
+    s->fd = fileno(f);
+    s->row_cap = row_cap;
+    if (s->fd < 0 || fstat(s->fd, &st) != 0) return 0;
+
+    if ((kind == OUT_MMAP || kind == OUT_AUTO) && can_map && S_ISREG(st.st_mode) &&
+        (format == GS_FMT_P6 || format == GS_FMT_P5) &&
+        (size_t)height <= (SIZE_MAX - start) / row_cap) {
+        size_t size = start + (size_t)height * row_cap;  /* binary rows are exactly row_cap */
+        void *p = MAP_FAILED;
+        if (ftruncate(s->fd, (off_t)size) == 0) {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+        }
+        if (p != MAP_FAILED) {
+            s->kind = OUT_MMAP;
+            s->map = p;
+            s->map_size = size;
+            s->map_pos = start;
+            return 1;
+        }
+    }
+
+    s->kind = OUT_WRITEV;
+    s->batch_rows = (int)(SINK_BATCH_BYTES / row_cap);
+#ifdef HAVE_VMSPLICE
+    if (kind == OUT_VMSPLICE && S_ISFIFO(st.st_mode)) {
+        /*
+         * A spliced slab may be reused once the next slab has been spliced
+         * in full: each row takes at least one pipe slot, so a slab of at
+         * least as many rows as the pipe has slots has pushed out the last.
+         */
+        long page = sysconf(_SC_PAGESIZE);
+        int pipe_size = fcntl(s->fd, F_GETPIPE_SZ);
+        int slots = page > 0 && pipe_size > 0 ? (int)(pipe_size / page) : SINK_MAX_IOV + 1;
+        if (slots <= SINK_MAX_IOV) {
+            s->kind = OUT_VMSPLICE;
+            if (s->batch_rows < slots) s->batch_rows = slots;
+        }
+    }
+#endif
+    if (s->batch_rows < 1) s->batch_rows = 1;
+    if (s->batch_rows > SINK_MAX_IOV) s->batch_rows = SINK_MAX_IOV;
+#ifdef IOV_MAX
+    if (s->batch_rows > IOV_MAX) s->batch_rows = IOV_MAX;
+#endif
+    s->slab_size = (size_t)s->batch_rows * row_cap;
+    for (int i = 0; i < (s->kind == OUT_VMSPLICE ? 2 : 1); i++) {
+        if ((s->slab[i] = sink_alloc(s->slab_size)) == NULL) return 0;
+    }
+    return 1;
+}
+
+/* Where to encode the next row (row_cap bytes). */
+static char *sink_row(struct row_sink *s) {
+    if (s->kind == OUT_MMAP) return s->map + s->map_pos;
+    return s->slab[s->cur] + (size_t)s->nrows * s->row_cap;
+}
+
+/* Writes all of iov, continuing after partial writes. Returns 0 on failure. */
+static int write_iov(int fd, struct iovec *iov, int n, int splice) {
+    (void)splice;
+    while (n > 0) {
+        ssize_t k;
+#ifdef HAVE_VMSPLICE
+        if (splice) k = vmsplice(fd, iov, (unsigned long)n, 0);
+        else
+#endif
+        k = writev(fd, iov, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        while (n > 0 && (size_t)k >= iov->iov_len) {
+            k -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + k;
+            iov->iov_len -= (size_t)k;
+        }
+    }
+    return 1;
+}
+
+static int sink_flush(struct row_sink *s) {
+    if (s->kind == OUT_MMAP || s->nrows == 0) return 1;
+    if (!write_iov(s->fd, s->iov, s->nrows, s->kind == OUT_VMSPLICE)) return 0;
+    s->first_row += s->nrows;
+    s->nrows = 0;
+    if (s->kind == OUT_VMSPLICE) s->cur ^= 1;
+    return 1;
+}
+
+/* Takes the len bytes just encoded at sink_row(). Returns 0 on write failure. */
+static int sink_commit(struct row_sink *s, size_t len) {
+    if (s->kind == OUT_MMAP) {
+        s->map_pos += len;
+        s->first_row++;
+        return 1;
+    }
+    s->iov[s->nrows].iov_base = sink_row(s);
+    s->iov[s->nrows].iov_len = len;
+    return ++s->nrows < s->batch_rows || sink_flush(s);
+}
+
+static void sink_close(struct row_sink *s) {
+    if (s->map) munmap(s->map, s->map_size);
+    for (int i = 0; i < 2; i++) {
+        if (s->slab[i]) munmap(s->slab[i], s->slab_size);
+    }
+    memset(s, 0, sizeof *s);
+}
+#endif
+
+/*
+ * --exact-size output of the first rows rows of a converted gray plane.
+ * Their histogram gives the exact output size, so a regular output file is
+ * sized and its blocks reserved up front, and the rows are formatted
+ * straight into a mapping of it; other outputs get one buffer of exactly
+ * that size and a single write. scratch is a gs_row_capacity() row for the
+ * last row, whose store overrun must not run past the end of the mapping.
+ * Stores the output size in *written. Returns 0 on success.
+ */
+static int write_exact(FILE *out, int can_map, const char *header, size_t header_len,
+                       int format, const unsigned char *plane, int width, int rows,
+                       char *scratch, size_t *written) {
+    uint64_t hist[256] = { 0 };
+    size_t npix = (size_t)width * rows;
+    char *dst = NULL;
+    int mapped = 0, ret = 1;
+
+    for (size_t i = 0; i < npix; i++) hist[plane[i]]++;
+    uint64_t body = gs_output_size(format, width, rows, hist);
+    if (body > SIZE_MAX - header_len - GS_ROW_SLACK) {
+        report_error("Error: Output too large (%llu bytes)\n", (unsigned long long)body);
+        return 1;
+    }
+    size_t size = header_len + (size_t)body;
+    *written = size;
+
+#ifdef HAVE_MMAP
+    struct stat st;
+    int fd = fileno(out);
+    if (can_map && fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (ftruncate(fd, (off_t)size) != 0) {
+            report_error("Error: Cannot size output file (%zu bytes)\n", size);
+            return 1;
+        }
+#ifdef HAVE_FALLOCATE
+        /* Reserve the blocks now: one extent, and no SIGBUS on a full disk */
+        int rc = posix_fallocate(fd, 0, (off_t)size);
+        if (rc != 0 && rc != EINVAL && rc != EOPNOTSUPP) {
+            report_error("Error: Cannot reserve %zu bytes for output\n", size);
+            return 1;
+        }
+#endif
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            dst = p;
+            mapped = 1;
+        }
+    }
+#else
+    (void)can_map;
+#endif
+    if (!mapped && (dst = malloc(size + GS_ROW_SLACK)) == NULL) {
+        report_error("Error: Cannot allocate output buffer (%zu bytes)\n", size);
+        return 1;
+    }
+
+    memcpy(dst, header, header_len);
+    size_t pos = header_len;
+    for (int y = 0; y < rows; y++) {
+        const unsigned char *gray = plane + (size_t)y * width;
+        if (mapped && y == rows - 1) {
+            size_t k = gs_format_row(format, gray, width, scratch);
+            memcpy(dst + pos, scratch, k);
+            pos += k;
+        } else {
+            pos += gs_format_row(format, gray, width, dst + pos);
+        }
+    }
+
+#ifdef HAVE_MMAP
+    if (mapped) {
+        munmap(dst, size);
+        ret = 0;
+    } else
+#endif
+    {
+        if (fwrite(dst, 1, size, out) == size) ret = 0;
+        else report_error("Error: Failed to write output (%zu bytes)\n", size);
+        free(dst);
+    }
+    return ret;
+}
+
+#ifdef HAVE_PTHREAD
+/* One token-aligned slice of the P3 pixel region. */
+struct p3_slice {
+    const unsigned char *begin, *end;
+    unsigned char *vals;    /* channel values in file order */
+    size_t cap;             /* max values to parse */
+    size_t count;           /* values parsed */
+    int trusted;            /* parse with the --trusted rules */
+    int malformed;          /* stopped on a malformed or out-of-range number */
+};
+
+static void *parse_slice(void *arg) {
+    struct p3_slice *sl = arg;
+    int rc;
+
+    sl->count = gs_parse_values(sl->begin, (size_t)(sl->end - sl->begin), sl->vals, sl->cap,
+                                sl->trusted, &rc);
+    sl->malformed = rc == 0;
+    return NULL;
+}
+
+/* A band of output rows encoded by one worker into its private buffer. */
+struct encode_band {
+    const struct gs_converter *conv;
+    const unsigned char *rgb;   /* first pixel of row y0 */
+    int out_format, width;
+    int y0, y1;
+    unsigned char *gray;        /* width-byte scratch row */
+    char *out;
+    size_t len;
+};
+
+static void *encode_band_worker(void *arg) {
+    struct encode_band *b = arg;
+    size_t row_bytes = (size_t)b->width * 3;
+
+    b->len = 0;
+    for (int y = b->y0; y < b->y1; y++) {
+        b->len += gs_encode_row(b->conv, b->out_format, b->rgb + (size_t)(y - b->y0) * row_bytes,
+                             b->width, b->gray, b->out + b->len);
+    }
+    return NULL;
+}
+
+/* Runs fn on every job, one thread each; jobs that fail to spawn run inline. */
+static void run_parallel(void *(*fn)(void *), void *jobs, size_t job_size, int n) {
+    pthread_t tid[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    for (int t = 0; t < n; t++) {
+        void *job = (char *)jobs + (size_t)t * job_size;
+        started[t] = t > 0 && pthread_create(&tid[t], NULL, fn, job) == 0;
+        if (!started[t] && t > 0) fn(job);
+    }
+    fn(jobs);  /* the calling thread takes the first job */
+    for (int t = 1; t < n; t++) {
+        if (started[t]) pthread_join(tid[t], NULL);
+    }
+}
+
+/*
+ * Picks a slice boundary at or after at. The byte after a '\n' is always
+ * outside a token and outside a comment. Past the last newline a plain
+ * whitespace byte is used, unless that tail holds a '#' (which would make
+ * the rest of the input a comment); then the slice runs to the end.
+ */
+static size_t find_split(const unsigned char *data, size_t len, size_t at,
+                         size_t tail_start, int tail_has_comment) {
+    if (at < tail_start) {
+        const unsigned char *nl = memchr(data + at, '\n', len - at);
+        return (size_t)(nl - data) + 1;  /* tail_start is one past the last newline */
+    }
+    if (tail_has_comment) return len;
+    while (at < len && !isspace(data[at])) at++;
+    return at < len ? at + 1 : len;
+}
+
+/*
+ * Parallel P3 decoder for --threads. The pixel region is cut into
+ * token-aligned slices that are parsed concurrently; a prefix sum over
+ * the per-slice value counts places them in one RGB plane, which is then
+ * converted and encoded in parallel row bands written out in order.
+ * Output and error messages match the serial loop. With the row offsets
+ * of an index (row_off, height + 1 of them, data at row_off[0]) the
+ * slices are cut at the rows closest to equal byte shares instead and
+ * parse straight into their rows of the plane. All buffers are blocks of
+ * the arena a. With st, parsing is booked as decode and the bands as
+ * encode (conversion included) and write. Returns 0 on success.
+ */
+static int convert_p3_threaded(const unsigned char *data, size_t len, int width, int height,
+                               const uint64_t *row_off, const struct gs_converter *conv,
+                               int out_format, int nthreads, int trusted, struct arena *a,
+                               FILE *out, struct stats *st) {
+    struct p3_slice slices[MAX_THREADS];
+    int slice_row[MAX_THREADS];     /* with row_off: first row of each slice */
+    struct encode_band bands[MAX_THREADS];
+    size_t needed = (size_t)width * height * 3;
+    size_t row_cap = gs_row_capacity(out_format, width);
+    unsigned char *plane = NULL;
+    int nslices = 0;
+    double t = st ? stats_now() : 0;
+
+    memset(bands, 0, sizeof bands);
+    if (nthreads > (int)(len / SLICE_MIN_BYTES) + 1) nthreads = (int)(len / SLICE_MIN_BYTES) + 1;
+
+    if (row_off) {
+        if ((plane = arena_alloc(a, needed)) == NULL) {
+            report_error("Error: Cannot allocate pixel plane (%zu bytes)\n", needed);
+            return 1;
+        }
+        int y0 = 0;
+        for (int t = 0; t < nthreads && y0 < height; t++) {
+            /* Slice ends at the first row starting at or after its byte share */
+            uint64_t share = row_off[0] + (uint64_t)len / nthreads * (t + 1);
+            int lo = y0 + 1, hi = height;
+            while (t < nthreads - 1 && lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (row_off[mid] < share) lo = mid + 1;
+                else hi = mid;
+            }
+            int y1 = t == nthreads - 1 ? height : lo;
+            uint64_t b = row_off[y0] - row_off[0];
+            uint64_t e = y1 == height ? len : row_off[y1] - row_off[0];
+            struct p3_slice *sl = &slices[nslices];
+            slice_row[nslices++] = y0;
+            sl->begin = data + (b < len ? b : len);
+            sl->end = data + (e < len ? e : len);
+            sl->vals = plane + (size_t)y0 * width * 3;
+            sl->cap = (size_t)(y1 - y0) * width * 3;
+            sl->count = 0;
+            sl->trusted = trusted;
+            sl->malformed = 0;
+            y0 = y1;
+        }
+        run_parallel(parse_slice, slices, sizeof slices[0], nslices);
+        for (int t = 0; t < nslices; t++) {
+            if (slices[t].count < slices[t].cap) {
+                size_t px = (size_t)slice_row[t] * width + slices[t].count / 3;
+                report_error("Error: Failed to read pixel data at row %d, col %d\n",
+                             (int)(px / (size_t)width), (int)(px % (size_t)width));
+                return 1;
+            }
+        }
+        goto parsed;
+    }
+
+    /* The tail after the last newline can only be split at plain whitespace */
+    size_t tail_start = len;
+    while (tail_start > 0 && data[tail_start - 1] != '\n') tail_start--;
+    int tail_has_comment = memchr(data + tail_start, '#', len - tail_start) != NULL;
+
+    size_t begin = 0;
+    for (int t = 0; t < nthreads && begin < len; t++) {
+        size_t end = t == nthreads - 1 ? len
+                     : find_split(data, len, len / nthreads * (t + 1) > begin
+                                             ? len / nthreads * (t + 1) : begin,
+                                  tail_start, tail_has_comment);
+        size_t bytes = end - begin;
+        struct p3_slice *sl = &slices[nslices++];
+        sl->begin = data + begin;
+        sl->end = data + end;
+        sl->cap = bytes / 2 + 1 < needed ? bytes / 2 + 1 : needed;  /* a value needs >= 2 bytes but the last */
+        sl->count = 0;
+        sl->trusted = trusted;
+        sl->malformed = 0;
+        if ((sl->vals = arena_alloc(a, sl->cap)) == NULL) {
+            report_error("Error: Cannot allocate decode buffer (%zu bytes)\n", sl->cap);
+            return 1;
+        }
+        begin = end;
+    }
+    run_parallel(parse_slice, slices, sizeof slices[0], nslices);
+
+    /* Prefix sum: place each slice's values and find the first failure */
+    if ((plane = arena_alloc(a, needed)) == NULL) {
+        report_error("Error: Cannot allocate pixel plane (%zu bytes)\n", needed);
+        return 1;
+    }
+    size_t total = 0;
+    for (int t = 0; t < nslices && total < needed; t++) {
+        size_t take = slices[t].count < needed - total ? slices[t].count : needed - total;
+        memcpy(plane + total, slices[t].vals, take);
+        total += take;
+        if (total < needed && slices[t].malformed) break;
+    }
+    if (total < needed) {
+        size_t px = total / 3;
+        report_error("Error: Failed to read pixel data at row %d, col %d\n",
+                     (int)(px / (size_t)width), (int)(px % (size_t)width));
+        return 1;
+    }
+parsed:
+    if (st) {
+        lap(&st->decode, &t);
+        st->values += needed;
+        st->rows += (uint64_t)height;
+    }
+
+    /* Encode in bands of rows; each worker fills its own buffer */
+    int rows_per_band = (int)(BAND_TARGET_BYTES / row_cap) + 1;
+    for (int t = 0; t < nthreads; t++) {
+        if ((bands[t].gray = arena_alloc(a, (size_t)width)) == NULL ||
+            (bands[t].out = arena_alloc(a, row_cap * (size_t)rows_per_band)) == NULL) {
+            report_error("Error: Cannot allocate row buffer (%zu bytes)\n",
+                         row_cap * (size_t)rows_per_band);
+            return 1;
+        }
+    }
+    for (int y = 0; y < height;) {
+        int n = 0;
+        for (; n < nthreads && y < height; n++) {
+            bands[n].conv = conv;
+            bands[n].rgb = plane + (size_t)y * width * 3;
+            bands[n].out_format = out_format;
+            bands[n].width = width;
+            bands[n].y0 = y;
+            bands[n].y1 = height - y > rows_per_band ? y + rows_per_band : height;
+            y = bands[n].y1;
+        }
+        run_parallel(encode_band_worker, bands, sizeof bands[0], n);
+        if (st) lap(&st->encode, &t);
+        for (int b = 0; b < n; b++) {
+            if (fwrite(bands[b].out, 1, bands[b].len, out) != bands[b].len) {
+                report_error("Error: Write failure at row %d\n", bands[b].y0);
+                return 1;
+            }
+            if (st) st->bytes_out += bands[b].len;
+        }
+        if (st) lap(&st->write, &t);
+    }
+    return 0;
+}
+#endif
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_PREAD)
+/*
+ * Parallel P6 loop for --threads with binary output. Every input and
+ * output row has a fixed size, so a strip of rows can be read, converted
+ * and written anywhere in the files without waiting for the others:
+ * workers pread() a strip into their own buffer (or take it from the
+ * mapped input), encode it and pwrite() it to its offset in the output.
+ * Strips are handed out one at a time from a shared counter, so a worker
+ * that is slow or descheduled takes fewer of them instead of holding up
+ * a fixed share.
+ */
+struct strip_queue {
+    pthread_mutex_t lock;
+    int next;                   /* first row of the next strip */
+    int fail_row;               /* first row of the earliest failed strip, or -1 */
+    uint64_t fail_px;           /* its first unread pixel, for a failed read */
+    int fail_read;
+    const struct gs_converter *conv;
+    int out_format, width, height, strip_rows;
+    size_t in_row, out_row;     /* bytes per input and output row */
+    const unsigned char *map;   /* first input row, or NULL to pread() */
+    int in_fd, out_fd;
+    off_t in_off, out_off;      /* where row 0 starts in the input and output */
+};
+
+struct strip_worker {
+    struct strip_queue *q;
+    unsigned char *rgb, *gray;  /* a strip of input rows, a gray row */
+    char *out;                  /* a strip of output rows */
+    uint64_t read_calls;
+};
+
+/* Reads len bytes at off, continuing after short reads. Returns the number read. */
+static size_t pread_full(int fd, unsigned char *buf, size_t len, off_t off, uint64_t *calls) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t k = pread(fd, buf + done, len - done, off + (off_t)done);
+        ++*calls;
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) break;
+        done += (size_t)k;
+    }
+    return done;
+}
+
+/* Writes len bytes at off, continuing after short writes. Returns 0 on failure. */
+static int pwrite_full(int fd, const char *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t k = pwrite(fd, buf, len, off);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        buf += k;
+        len -= (size_t)k;
+        off += k;
+    }
+    return 1;
+}
+
+/* Records a failed strip; the earliest one is reported. */
+static void strip_fail(struct strip_queue *q, int row, int read, uint64_t px) {
+    pthread_mutex_lock(&q->lock);
+    if (q->fail_row < 0 || row < q->fail_row) {
+        q->fail_row = row;
+        q->fail_read = read;
+        q->fail_px = px;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *strip_worker_run(void *arg) {
+    struct strip_worker *w = arg;
+    struct strip_queue *q = w->q;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        int y0 = q->fail_row < 0 ? q->next : q->height;  /* stop early after a failure */
+        if (y0 < q->height) q->next += q->strip_rows;
+        pthread_mutex_unlock(&q->lock);
+        if (y0 >= q->height) break;
+
+        int n = q->height - y0 < q->strip_rows ? q->height - y0 : q->strip_rows;
+        const unsigned char *rgb = w->rgb;
+        if (q->map) {
+            rgb = q->map + (size_t)y0 * q->in_row;
+        } else {
+            size_t want = (size_t)n * q->in_row;
+            off_t at = q->in_off + (off_t)y0 * (off_t)q->in_row;
+            size_t got = pread_full(q->in_fd, w->rgb, want, at, &w->read_calls);
+            if (got < want) {
+                strip_fail(q, y0, 1, (uint64_t)y0 * (uint64_t)q->width + got / 3);
+                break;
+            }
+        }
+        char *o = w->out;
+        for (int y = 0; y < n; y++) {
+            o += gs_encode_row(q->conv, q->out_format, rgb + (size_t)y * q->in_row, q->width,
+                               w->gray, o);
+        }
+        if (!pwrite_full(q->out_fd, w->out, (size_t)(o - w->out),
+                         q->out_off + (off_t)y0 * (off_t)q->out_row)) {
+            strip_fail(q, y0, 0, 0);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Converts the P6 raster of a width x height maxval-255 image with
+ * nthreads workers. The input is the mapping data, or else in_fd from
+ * in_off; either way len bytes follow the header. The output is the
+ * regular file out_fd, whose first out_off bytes are already written. A
+ * raster shorter than the header promises is reported before anything is
+ * converted. Buffers are blocks of the arena a. With st the whole loop,
+ * which reads, converts and writes at once, is booked as convert.
+ * Returns 0 on success.
+ */
+static int convert_p6_strips(const unsigned char *data, uint64_t len, int in_fd, off_t in_off,
+                             int width, int height, const struct gs_converter *conv,
+                             int out_format, int nthreads, int out_fd, off_t out_off,
+                             struct arena *a, struct stats *st) {
+    struct strip_queue q;
+    struct strip_worker workers[MAX_THREADS];
+    size_t in_row = (size_t)width * 3, out_row = gs_row_capacity(out_format, width);
+    uint64_t raster = (uint64_t)in_row * (uint64_t)height;
+    double t = st ? stats_now() : 0;
+
+    if (len < raster) {
+        uint64_t px = len / 3;
+        report_error("Error: Failed to read pixel data at row %d, col %d\n",
+                     (int)(px / (uint64_t)width), (int)(px % (uint64_t)width));
+        return 1;
+    }
+
+    memset(&q, 0, sizeof q);
+    q.fail_row = -1;
+    q.conv = conv;
+    q.out_format = out_format;
+    q.width = width;
+    q.height = height;
+    q.strip_rows = in_row < STRIP_TARGET_BYTES ? (int)(STRIP_TARGET_BYTES / in_row) : 1;
+    q.in_row = in_row;
+    q.out_row = out_row;
+    q.map = data;
+    q.in_fd = in_fd;
+    q.out_fd = out_fd;
+    q.in_off = in_off;
+    q.out_off = out_off;
+    if (nthreads > (height + q.strip_rows - 1) / q.strip_rows) {
+        nthreads = (height + q.strip_rows - 1) / q.strip_rows;
+    }
+
+#ifdef HAVE_FALLOCATE
+    /* One extent for the whole output, although the strips land out of order */
+    posix_fallocate(out_fd, out_off, (off_t)(out_row * (uint64_t)height));
+#endif
+    size_t strip_in = in_row * (size_t)q.strip_rows, strip_out = out_row * (size_t)q.strip_rows;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].q = &q;
+        workers[i].read_calls = 0;
+        workers[i].rgb = NULL;
+        if ((data == NULL && (workers[i].rgb = arena_alloc(a, strip_in)) == NULL) ||
+            (workers[i].gray = arena_alloc(a, (size_t)width)) == NULL ||
+            (workers[i].out = arena_alloc(a, strip_out)) == NULL) {
+            report_error("Error: Cannot allocate row buffer (%zu bytes)\n", strip_in + strip_out);
+            return 1;
+        }
+    }
+    pthread_mutex_init(&q.lock, NULL);
+    run_parallel(strip_worker_run, workers, sizeof workers[0], nthreads);
+    pthread_mutex_destroy(&q.lock);
+
+    if (q.fail_row >= 0 && q.fail_read) {
+        report_error("Error: Failed to read pixel data at row %d, col %d\n",
+                     (int)(q.fail_px / (uint64_t)width), (int)(q.fail_px % (uint64_t)width));
+        return 1;
+    }
+    if (q.fail_row >= 0) {
+        report_error("Error: Write failure at row %d\n", q.fail_row);
+        return 1;
+    }
+    if (st) {
+        lap(&st->convert, &t);
+        st->rows += (uint64_t)height;
+        st->values += raster;
+        st->bytes_out += out_row * (uint64_t)height;
+        if (data == NULL) {
+            st->bytes_in += raster;
+            for (int i = 0; i < nthreads; i++) st->read_calls += workers[i].read_calls;
+        }
+    }
+    return 0;
+}
+#endif
+
+/* Maps a "-f" argument (p2/p3/p5/p6, any case) to a format. Returns -1 if unknown. */
+static int parse_format(const char *s) {
+    if ((s[0] != 'p' && s[0] != 'P') || s[1] == '\0' || s[2] != '\0') return -1;
+    switch (s[1]) {
+    case '3': return GS_FMT_P3;
+    case '6': return GS_FMT_P6;
+    case '2': return GS_FMT_P2;
+    case '5': return GS_FMT_P5;
+    default: return -1;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-f p3|p6|p2|p5] [-m MODE | -w R,G,B] [--linear] [-g GAMMA]\n"
+            "          [--no-mmap] [--no-simd] [--threads N] [--pipeline] [--output-io IO]\n"
+            "          [--exact-size] [--crop X,Y,W,H] [--scale 1/N] [--depth 8] [--trusted]\n"
+            "          [--index] [--cache-dir DIR] [--arena-max MIB] [--checkpoint]\n"
+            "          [--stats[=json]] [INPUT [OUTPUT]]\n"
+            "       %s --batch [options] [--manifest FILE] [--out-dir DIR] INPUT...\n"
+            "       %s --serve SOCKET|- [options] [--out-dir DIR]\n"
+            "  INPUT, OUTPUT      image paths (default " INPUT_FILE ", " OUTPUT_FILE "); \"-\" is stdin/stdout\n"
+            "  -f, --format FMT   output format: p3 (ASCII, default), p6 (binary),\n"
+            "                     or single-channel PGM p2 (ASCII) / p5 (binary)\n"
+            "  -m, --mode MODE    grayscale weighting: average (default), bt601, bt709\n"
+            "  -w, --weights R,G,B  custom channel weights, normalized to sum to 1\n"
+            "  --linear           mix channels in linear light (sRGB decode/encode)\n"
+            "  -g, --gamma G      apply the output tone curve v^(1/G)\n"
+            "  --no-mmap          read input through stdio even if it can be mapped\n"
+            "  --no-simd          use the scalar P3 tokenizer and conversion kernels only\n"
+            "  --trusted          skip the pixel-data checks for known-good input: no\n"
+            "                     comments or range checks inside the raster\n"
+            "  -t, --threads N    decode P3 input, or convert P6 input to p5/p6, with N\n"
+            "                     threads (0 = one per CPU); in batch mode the worker\n"
+            "                     pool size (default: one per CPU)\n"
+            "  --pipeline         overlap reading and writing with conversion (I/O threads)\n"
+            "  --output-io IO     stdio (default), writev, vmsplice (stdout pipe), mmap\n"
+            "                     (binary output file) or auto (mmap, else writev)\n"
+            "  --arena-max MIB    keep at most MIB of buffers per worker between images\n"
+            "                     (default 64; 0 allocates each image's buffers anew)\n"
+            "  --exact-size       convert the whole image first, then reserve and write\n"
+            "                     the output at its exact size in one go\n"
+            "  --crop X,Y,W,H     convert only the W x H region at X,Y\n"
+            "  --scale 1/N        downscale by 2, 4 or 8 (box filter) while decoding\n"
+            "  --depth 8          write maxval 255 even if the input maxval is not 255\n"
+            "  --index            keep INPUT.gsidx with the row offsets of INPUT, to seek\n"
+            "                     to rows and split --threads work without scanning\n"
+            "  --cache-dir DIR    keep the decoded pixels of P3 inputs in DIR and convert\n"
+            "                     from there next time, without parsing\n"
+            "  --checkpoint       keep OUTPUT.gsck while converting, so that a failed run\n"
+            "                     keeps its output and the next one resumes there\n"
+            "  --stats[=json]     print timings and I/O counters to stderr when done\n"
+            "                     (a table, or one JSON line)\n"
+            "  --batch            convert every INPUT (file, directory of *.ppm, or glob)\n"
+            "  --manifest FILE    batch inputs from FILE, one per line: INPUT[<tab>OUTPUT]\n"
+            "  --out-dir DIR      batch outputs go to DIR instead of next to the input\n"
+            "  --serve SOCKET     convert requests from a Unix socket (\"-\": stdin) with a\n"
+            "                     pool of warm workers, until stopped\n",
+            prog, prog, prog);
+}
+
+/*
+ * Matches "--name VALUE", "--name=VALUE" or the short form "-x VALUE".
+ * On success stores the value, advances *i past it and returns 1.
+ */
+static int match_option(int argc, char **argv, int *i, const char *shrt,
+                        const char *lng, const char **value) {
+    const char *arg = argv[*i];
+    size_t len = strlen(lng);
+
+    if (strncmp(arg, lng, len) == 0 && arg[len] == '=') {
+        *value = arg + len + 1;
+        return 1;
+    }
+    if ((strcmp(arg, lng) == 0 || (shrt && strcmp(arg, shrt) == 0)) && *i + 1 < argc) {
+        *value = argv[++*i];
+        return 1;
+    }
+    return 0;
+}
+
+/* Settings shared by every image of a run. */
+struct options {
+    const struct gs_converter *conv;
+    int out_format;
+    int use_mmap;
+    int pipeline;       /* --pipeline: reader/writer threads around the row loop */
+    int output_io;      /* enum output_io, for the single-threaded row loop */
+    int exact_size;     /* --exact-size: size the output exactly, write it at once */
+    int nthreads;       /* resolved: >= 1; in batch mode the worker count */
+    int crop_x, crop_y, crop_w, crop_h;     /* --crop; crop_w 0 is the whole image */
+    int scale_shift;    /* --scale: output is 1 / (1 << scale_shift) of the region */
+    int depth8;         /* --depth 8: write maxval 255 whatever the input maxval */
+    int use_index;      /* --index: read and maintain INPUT.gsidx */
+    const char *cache_dir;  /* --cache-dir: decoded rasters of P3 inputs, or NULL */
+    size_t arena_max;   /* --arena-max: high-water mark of each worker's arena, bytes */
+    int trusted;        /* --trusted: skip the pixel-data checks (gs_decoder.trusted) */
+    int checkpoint;     /* --checkpoint: resumable output with OUTPUT.gsck */
+};
+
+/*
+ * gs_encode_row() for the row loops. With st the time since *t is booked
+ * as decode, and the conversion and the encoding are timed separately.
+ */
+static size_t encode_row(const struct options *opt, const unsigned char *rgb, int width,
+                         unsigned char *gray, char *out, struct stats *st, double *t) {
+    if (st == NULL) return gs_encode_row(opt->conv, opt->out_format, rgb, width, gray, out);
+    lap(&st->decode, t);
+    gs_convert_row(opt->conv, rgb, gray, width);
+    lap(&st->convert, t);
+    size_t len = gs_format_row(opt->out_format, gray, width, out);
+    lap(&st->encode, t);
+    st->bytes_out += len;
+    return len;
+}
+
+/*
+ * Buffers of the image a worker is converting. All of them are blocks of
+ * the worker's arena, which worker_buffers_reset() takes back before the
+ * next image; the caps are those of the blocks.
+ */
+struct worker_buffers {
+    struct arena arena;
+    char *out_buf;                  /* BUFFER_SIZE stdio buffer */
+    unsigned char *pix_buf;         /* GS_CHUNK_SIZE decoder chunk */
+    char *row_buf;
+    unsigned char *rgb_row, *gray_row;
+    unsigned char *plane;           /* --exact-size: the whole image in gray */
+    uint32_t *sums;                 /* --scale: column sums of one output row */
+    uint16_t *rgb16, *gray16;       /* rows of images with maxval != 255 */
+    size_t row_cap, rgb_cap, gray_cap, plane_cap, sums_cap, rgb16_cap, gray16_cap;
+};
+
+/*
+ * Makes *buf at least need bytes, as a new block of the arena if it is
+ * smaller; the contents are not kept. Returns 0 on allocation failure.
+ */
+static int reserve(struct arena *a, void *buf, size_t *cap, size_t need) {
+    void **p = buf;
+    if (*cap >= need) return 1;
+    void *block = arena_alloc(a, need);
+    if (block == NULL) return 0;
+    *p = block;
+    *cap = need;
+    return 1;
+}
+
+static void worker_buffers_init(struct worker_buffers *wb, size_t arena_max) {
+    memset(wb, 0, sizeof *wb);
+    arena_init(&wb->arena, arena_max);
+}
+
+/* Gives every buffer back to the arena, ahead of the next image. */
+static void worker_buffers_reset(struct worker_buffers *wb) {
+    struct arena arena = wb->arena;
+    memset(wb, 0, sizeof *wb);
+    wb->arena = arena;
+    arena_reset(&wb->arena);
+}
+
+static void worker_buffers_free(struct worker_buffers *wb) {
+    arena_free(&wb->arena);
+    memset(wb, 0, sizeof *wb);
+}
+
+/* Prints the message for a failed gs_read_header()/gs_read_row(). */
+static void report_decode_error(const struct gs_decoder *d, int status) {
+    switch (status) {
+    case GS_ERR_HEADER_EOF:
+        report_error("Error: Unexpected EOF in header\n");
+        break;
+    case GS_ERR_MAGIC:
+        report_error("Error: Unsupported PPM magic number (expected P3 or P6)\n");
+        break;
+    case GS_ERR_DIMENSIONS:
+        report_error("Error: Failed to read image dimensions\n");
+        break;
+    case GS_ERR_BAD_DIMENSIONS:
+        report_error("Error: Invalid image dimensions (%dx%d), must be 1-%d\n",
+                     d->width, d->height, GS_MAX_DIMENSION);
+        break;
+    case GS_ERR_TOO_LARGE:
+        report_error("Error: Image too large (%dx%d pixels)\n", d->width, d->height);
+        break;
+    case GS_ERR_MAXVAL:
+        report_error("Error: Failed to read maximum color value\n");
+        break;
+    case GS_ERR_BAD_MAXVAL:
+        report_error("Error: Maximum color value must be 1-%d (got %d)\n", GS_MAX_MAXVAL,
+                     d->maxval);
+        break;
+    case GS_ERR_SEPARATOR:
+        report_error("Error: Missing whitespace after P6 header\n");
+        break;
+    default:
+        report_error("Error: Failed to read pixel data at row %d, col %d\n",
+                     d->err_row, d->err_col);
+        break;
+    }
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Bounded single-producer/single-consumer queue of fixed-size buffers.
+ * The producer fills the slot returned by ring_acquire() and hands it over
+ * with ring_publish(); the consumer reads it via ring_peek() and gives it
+ * back with ring_release(). Either side may ring_close(): the producer
+ * then gets no more slots, and the consumer sees the end once drained.
+ */
+struct chunk_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *buf[PIPE_SLOTS];
+    size_t len[PIPE_SLOTS];
+    int tag[PIPE_SLOTS];        /* first output row of the chunk */
+    unsigned head, tail;        /* next slot to consume / to fill */
+    int closed;
+};
+
+static int ring_init(struct chunk_ring *r, size_t cap) {
+    memset(r, 0, sizeof *r);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    for (int i = 0; i < PIPE_SLOTS; i++) {
+        if ((r->buf[i] = malloc(cap)) == NULL) return 0;
+    }
+    return 1;
+}
+
+static void ring_free(struct chunk_ring *r) {
+    for (int i = 0; i < PIPE_SLOTS; i++) free(r->buf[i]);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+}
+
+/* Producer: waits for a free slot. Returns NULL once the ring is closed. */
+static unsigned char *ring_acquire(struct chunk_ring *r) {
+    unsigned char *p = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->closed && r->tail - r->head == PIPE_SLOTS) pthread_cond_wait(&r->cond, &r->lock);
+    if (!r->closed) p = r->buf[r->tail % PIPE_SLOTS];
+    pthread_mutex_unlock(&r->lock);
+    return p;
+}
+
+static void ring_publish(struct chunk_ring *r, size_t len, int tag) {
+    pthread_mutex_lock(&r->lock);
+    r->len[r->tail % PIPE_SLOTS] = len;
+    r->tag[r->tail % PIPE_SLOTS] = tag;
+    r->tail++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Consumer: waits for a filled slot. Returns NULL when closed and drained. */
+static unsigned char *ring_peek(struct chunk_ring *r, size_t *len, int *tag) {
+    unsigned char *p = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->closed && r->head == r->tail) pthread_cond_wait(&r->cond, &r->lock);
+    if (r->head != r->tail) {
+        p = r->buf[r->head % PIPE_SLOTS];
+        *len = r->len[r->head % PIPE_SLOTS];
+        *tag = r->tag[r->head % PIPE_SLOTS];
+    }
+    pthread_mutex_unlock(&r->lock);
+    return p;
+}
+
+static void ring_release(struct chunk_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    r->head++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_close(struct chunk_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    r->closed = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * --pipeline: a reader thread fills input chunks and a writer thread drains
+ * encoded output chunks while the calling thread decodes, converts and
+ * encodes, so file I/O latency overlaps with parsing. The decoder takes
+ * the input chunks in place through a chunk source, and rows are encoded
+ * straight into the output chunks.
+ */
+struct pipeline {
+    struct chunk_ring in, out;
+    FILE *in_file, *out_file;
+    pthread_t reader, writer;
+    int reader_started, writer_started;
+    int holding;                /* the decoder still uses the in-ring head slot */
+    int write_failed, failed_row;
+};
+
+static void *pipeline_reader(void *arg) {
+    struct pipeline *p = arg;
+    unsigned char *buf;
+
+    while ((buf = ring_acquire(&p->in)) != NULL) {
+        size_t n = fread(buf, 1, GS_CHUNK_SIZE, p->in_file);
+        if (n == 0) break;  /* EOF or read error: the decoder reports short data */
+        ring_publish(&p->in, n, 0);
+    }
+    ring_close(&p->in);
+    return NULL;
+}
+
+static void *pipeline_writer(void *arg) {
+    struct pipeline *p = arg;
+    unsigned char *buf;
+    size_t len;
+    int row;
+
+    while ((buf = ring_peek(&p->out, &len, &row)) != NULL) {
+        if (!p->write_failed && fwrite(buf, 1, len, p->out_file) != len) {
+            p->write_failed = 1;
+            p->failed_row = row;
+            ring_close(&p->out);  /* stops the encoder at its next chunk */
+        }
+        ring_release(&p->out);
+    }
+    return NULL;
+}
+
+/* gs_next_chunk_fn over the input ring. */
+static size_t pipeline_next_chunk(void *ctx, const unsigned char **chunk) {
+    struct pipeline *p = ctx;
+    unsigned char *buf;
+    size_t len;
+    int tag;
+
+    if (p->holding) ring_release(&p->in);
+    p->holding = 0;
+    if ((buf = ring_peek(&p->in, &len, &tag)) == NULL) return 0;
+    p->holding = 1;
+    *chunk = buf;
+    return len;
+}
+
+/*
+ * read_all() for a piped input: collects the rest of the input ring after
+ * the head bytes the decoder holds. Returns NULL on allocation failure.
+ */
+static unsigned char *pipeline_read_all(struct pipeline *p, const unsigned char *head,
+                                        size_t head_len, size_t *len) {
+    size_t cap = head_len + GS_CHUNK_SIZE, n = head_len;
+    unsigned char *buf = malloc(cap);
+    const unsigned char *chunk;
+    size_t k;
+
+    if (buf == NULL) return NULL;
+    memcpy(buf, head, head_len);  /* before the next call releases its slot */
+    while ((k = pipeline_next_chunk(p, &chunk)) != 0) {
+        if (cap - n < k) {
+            unsigned char *grown = cap <= SIZE_MAX / 2 ? realloc(buf, cap * 2) : NULL;
+            if (grown == NULL) {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        memcpy(buf + n, chunk, k);
+        n += k;
+    }
+    *len = n;
+    return buf;
+}
+
+/* Starts the reader thread. Returns 0 on failure. */
+static int pipeline_start_reader(struct pipeline *p, FILE *in) {
+    memset(p, 0, sizeof *p);
+    p->in_file = in;
+    if (!ring_init(&p->in, GS_CHUNK_SIZE)) return 0;
+    p->reader_started = pthread_create(&p->reader, NULL, pipeline_reader, p) == 0;
+    return p->reader_started;
+}
+
+/* Starts the writer thread with out_cap-byte output chunks. Returns 0 on failure. */
+static int pipeline_start_writer(struct pipeline *p, FILE *out, size_t out_cap) {
+    p->out_file = out;
+    if (!ring_init(&p->out, out_cap)) return 0;
+    p->writer_started = pthread_create(&p->writer, NULL, pipeline_writer, p) == 0;
+    return p->writer_started;
+}
+
+/*
+ * Shuts both stages down: the writer first drains what has been published,
+ * the reader stops at its next chunk. Safe after a partial start.
+ */
+static void pipeline_stop(struct pipeline *p) {
+    ring_close(&p->out);
+    if (p->writer_started) pthread_join(p->writer, NULL);
+    ring_close(&p->in);
+    if (p->reader_started) pthread_join(p->reader, NULL);
+    ring_free(&p->in);
+    if (p->out_file) ring_free(&p->out);
+    p->writer_started = p->reader_started = 0;
+}
+
+/*
+ * Pipelined row loop: encodes rows back to back into output chunks and
+ * publishes each chunk when the next row might not fit. Errors are
+ * reported as in the serial loop, except that a write failure names the
+ * first row of the chunk that failed. Returns 0 on success.
+ */
+static int convert_rows_pipelined(struct pipeline *p, struct gs_decoder *dec,
+                                  const struct options *opt, unsigned char *rgb_row,
+                                  unsigned char *gray_row, size_t row_cap, size_t out_cap,
+                                  struct stats *st) {
+    unsigned char *chunk = NULL;
+    size_t used = 0;
+    int chunk_row = 0, rc;
+    double t = st ? stats_now() : 0;
+
+    for (int y = 0; y < dec->height; y++) {
+        const unsigned char *rgb;
+
+        if ((rc = gs_read_row(dec, rgb_row, &rgb)) != GS_OK) {
+            if (chunk) ring_publish(&p->out, used, chunk_row);  /* rows before it, as the serial loop */
+            report_decode_error(dec, rc);
+            return 1;
+        }
+        if (chunk == NULL || out_cap - used < row_cap) {
+            if (st) lap(&st->decode, &t);
+            if (chunk) ring_publish(&p->out, used, chunk_row);
+            chunk = ring_acquire(&p->out);  /* waits for the writer */
+            if (st) lap(&st->write, &t);
+            if (chunk == NULL) break;  /* writer failed */
+            used = 0;
+            chunk_row = y;
+        }
+        used += encode_row(opt, rgb, dec->width, gray_row, (char *)chunk + used, st, &t);
+    }
+    if (chunk) ring_publish(&p->out, used, chunk_row);
+    ring_close(&p->out);
+    pthread_join(p->writer, NULL);
+    p->writer_started = 0;
+    if (st) lap(&st->write, &t);
+    if (p->write_failed) {
+        report_error("Error: Write failure at row %d\n", p->failed_row);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Row loop for --crop/--scale. Rows above the region are skipped (unless
+ * the decoder already starts at row y, from an index) and the columns
+ * outside it are passed over by the decoder without converting them;
+ * rows below it are never read. With a scale of 1/f each output pixel
+ * is the rounded mean of an f x f block of gray pixels (fewer at the
+ * right and bottom edges). Needs width-byte rgb_row/gray_row and a
+ * row_buf for out_w pixels. Returns 0 on success.
+ */
+static int convert_region(struct gs_decoder *dec, const struct options *opt, int x, int y,
+                          int w, int h, FILE *out, struct worker_buffers *wb,
+                          struct stats *st) {
+    int shift = opt->scale_shift, f = 1 << shift;
+    int out_w = (w + f - 1) >> shift, out_h = (h + f - 1) >> shift;
+    unsigned char *gray = wb->gray_row;
+    uint32_t *sums = NULL;
+    double t = st ? stats_now() : 0;
+    int rc;
+
+    if (shift && !reserve(&wb->arena, &wb->sums, &wb->sums_cap, (size_t)out_w * sizeof *sums)) {
+        report_error("Error: Cannot allocate row buffer (%zu bytes)\n",
+                     (size_t)out_w * sizeof *sums);
+        return 1;
+    }
+    sums = wb->sums;
+    if ((rc = gs_skip_rows(dec, y - dec->row)) != GS_OK) {
+        report_decode_error(dec, rc);
+        return 1;
+    }
+    for (int oy = 0; oy < out_h; oy++) {
+        int rows = h - (oy << shift) < f ? h - (oy << shift) : f;
+
+        if (shift) memset(sums, 0, (size_t)out_w * sizeof *sums);
+        for (int r = 0; r < rows; r++) {
+            const unsigned char *rgb;
+            if ((rc = gs_read_row_part(dec, x, w, wb->rgb_row, &rgb)) != GS_OK) {
+                report_decode_error(dec, rc);
+                return 1;
+            }
+            if (st) lap(&st->decode, &t);
+            gs_convert_row(opt->conv, rgb, gray, w);
+            if (st) lap(&st->convert, &t);
+            for (int i = 0; shift && i < w; i++) sums[i >> shift] += gray[i];
+        }
+        /* Box filter: the block mean replaces the first out_w gray samples */
+        for (int ox = 0; shift && ox < out_w; ox++) {
+            int cols = w - (ox << shift) < f ? w - (ox << shift) : f;
+            uint32_t n = (uint32_t)(rows * cols);
+            gray[ox] = (unsigned char)((sums[ox] + n / 2) / n);
+        }
+        size_t len = gs_format_row(opt->out_format, gray, out_w, wb->row_buf);
+        if (st) {
+            lap(&st->encode, &t);
+            st->bytes_out += len;
+        }
+        if (fwrite(wb->row_buf, 1, len, out) != len) {
+            report_error("Error: Write failure at row %d\n", oy);
+            return 1;
+        }
+        if (st) lap(&st->write, &t);
+    }
+    return 0;
+}
+
+/*
+ * Row loop for rows wider than TILE_PIXELS: each row is decoded, converted
+ * and written in tiles of up to TILE_PIXELS pixels, so memory stays the
+ * same however wide the image is. rgb_row, gray_row and row_buf hold one
+ * tile. Returns 0 on success.
+ */
+static int convert_tiled(struct gs_decoder *dec, const struct options *opt, FILE *out,
+                         struct worker_buffers *wb, struct stats *st) {
+    int width = dec->width;
+    double t = st ? stats_now() : 0;
+    int rc;
+
+    for (int y = 0; y < dec->height; y++) {
+        for (int x = 0; x < width; x += TILE_PIXELS) {
+            int n = width - x < TILE_PIXELS ? width - x : TILE_PIXELS;
+            const unsigned char *rgb;
+            if ((rc = gs_read_pixels(dec, wb->rgb_row, n, &rgb)) != GS_OK) {
+                report_decode_error(dec, rc);
+                return 1;
+            }
+            if (st) lap(&st->decode, &t);
+            gs_convert_row(opt->conv, rgb, wb->gray_row, n);
+            if (st) lap(&st->convert, &t);
+            size_t len = gs_format_span(opt->out_format, wb->gray_row, n, x + n == width,
+                                        wb->row_buf);
+            if (st) {
+                lap(&st->encode, &t);
+                st->bytes_out += len;
+            }
+            if (fwrite(wb->row_buf, 1, len, out) != len) {
+                report_error("Error: Write failure at row %d\n", y);
+                return 1;
+            }
+            if (st) lap(&st->write, &t);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Row loop for images whose maxval is not 255: rows are decoded and
+ * converted with 16-bit samples and written at out_maxval, which is either
+ * the input maxval or 255 (--depth 8, the gray row is rescaled first).
+ * Like convert_tiled() it works in tiles of up to TILE_PIXELS pixels;
+ * gray_row must hold a tile and row_buf a tile at out_maxval.
+ * Returns 0 on success.
+ */
+static int convert_wide(struct gs_decoder *dec, const struct options *opt, int out_maxval,
+                        FILE *out, struct worker_buffers *wb, struct stats *st) {
+    int width = dec->width;
+    int tile = width < TILE_PIXELS ? width : TILE_PIXELS;
+    size_t rgb_size = (size_t)tile * 3 * sizeof *wb->rgb16;
+    double t = st ? stats_now() : 0;
+    int rc;
+
+    if (!reserve(&wb->arena, &wb->rgb16, &wb->rgb16_cap, rgb_size) ||
+        !reserve(&wb->arena, &wb->gray16, &wb->gray16_cap, (size_t)tile * sizeof *wb->gray16)) {
+        report_error("Error: Cannot allocate row buffer (%zu bytes)\n", rgb_size);
+        return 1;
+    }
+    for (int y = 0; y < dec->height; y++) {
+        for (int x = 0; x < width; x += tile) {
+            int n = width - x < tile ? width - x : tile;
+            if ((rc = gs_read_pixels16(dec, wb->rgb16, n)) != GS_OK) {
+                report_decode_error(dec, rc);
+                return 1;
+            }
+            if (st) lap(&st->decode, &t);
+            gs_convert_row16(opt->conv, wb->rgb16, wb->gray16, n);
+            if (st) lap(&st->convert, &t);
+            size_t len;
+            if (out_maxval == 255) {
+                gs_scale_row8(wb->gray16, n, dec->maxval, wb->gray_row);
+                len = gs_format_span(opt->out_format, wb->gray_row, n, x + n == width,
+                                     wb->row_buf);
+            } else {
+                len = gs_format_span16(opt->out_format, wb->gray16, n, out_maxval,
+                                       x + n == width, wb->row_buf);
+            }
+            if (st) {
+                lap(&st->encode, &t);
+                st->bytes_out += len;
+            }
+            if (fwrite(wb->row_buf, 1, len, out) != len) {
+                report_error("Error: Write failure at row %d\n", y);
+                return 1;
+            }
+            if (st) lap(&st->write, &t);
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_MMAP
+/*
+ * Decoded-pixel cache for --cache-dir. The first conversion of a P3 input
+ * with maxval 255 stores its RGB raster in DIR as a P6 image. The file is
+ * named after the input's device, inode, size and mtime, and carries them
+ * in a header comment. Later conversions read it in place of the input,
+ * so the raster reaches the converter mapped and without any parsing.
+ */
+#define CACHE_SUFFIX ".gsrgb"
+
+/* Opens the cache file at path if it holds an image tagged tag, else returns NULL. */
+static FILE *cache_open(const char *path, const char *tag) {
+    char head[128];
+    size_t tag_len = strlen(tag);
+    struct stat st;
+    int w = 0, h = 0, n = 0;
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) return NULL;
+    size_t got = fread(head, 1, sizeof head - 1, f);
+    head[got] = '\0';
+    if (got > tag_len && memcmp(head, tag, tag_len) == 0 &&
+        sscanf(head + tag_len, "%d %d 255%n", &w, &h, &n) == 2 && n > 0 && w > 0 && h > 0 &&
+        head[tag_len + n] == '\n' && fstat(fileno(f), &st) == 0 &&
+        (uint64_t)st.st_size == tag_len + n + 1 + (uint64_t)w * h * 3 &&
+        fseek(f, 0, SEEK_SET) == 0) {
+        return f;
+    }
+    fclose(f);
+    return NULL;
+}
+
+/*
+ * Decodes the input f into a new cache file at path, in tiles of at most
+ * TILE_PIXELS pixels, and returns it opened. Returns NULL if the input is
+ * not P3 with maxval 255 or does not decode, or if the file cannot be
+ * written. Either way f is rewound for the caller.
+ */
+static FILE *cache_fill(FILE *f, const char *path, const char *tag, const struct options *opt,
+                        struct worker_buffers *wb, struct stats *st) {
+    char tmp[4200];
+    struct input_map map = { NULL, 0 };
+    struct gs_decoder dec;
+    FILE *out = NULL, *cached = NULL;
+    double t = st ? stats_now() : 0;
+
+    if (opt->use_mmap && map_input(f, &map)) {
+        gs_decoder_init_mem(&dec, map.data, map.size);
+    } else if (wb->pix_buf != NULL ||
+               (wb->pix_buf = arena_alloc(&wb->arena, GS_CHUNK_SIZE)) != NULL) {
+        gs_decoder_init_file(&dec, f, wb->pix_buf);
+    } else {
+        return NULL;
+    }
+    if (gs_read_header(&dec) == GS_OK && dec.format == GS_FMT_P3 && dec.maxval == 255 &&
+        reserve(&wb->arena, &wb->rgb_row, &wb->rgb_cap, (size_t)TILE_PIXELS * 3)) {
+        snprintf(tmp, sizeof tmp, "%s.%ld.tmp", path, (long)getpid());
+        out = fopen(tmp, "wb");
+    }
+    if (out) {
+        int ok = fprintf(out, "%s%d %d\n255\n", tag, dec.width, dec.height) > 0;
+        for (int y = 0; ok && y < dec.height; y++) {
+            for (int x = 0, n; ok && x < dec.width; x += n) {
+                const unsigned char *rgb;
+                n = dec.width - x < TILE_PIXELS ? dec.width - x : TILE_PIXELS;
+                ok = gs_read_pixels(&dec, wb->rgb_row, n, &rgb) == GS_OK &&
+                     fwrite(rgb, 3, (size_t)n, out) == (size_t)n;
+            }
+        }
+        if (fclose(out) != 0) ok = 0;
+        if (ok && rename(tmp, path) == 0) cached = cache_open(path, tag);
+        else remove(tmp);
+    }
+    if (st) {
+        struct gs_counters c;
+        gs_decoder_counters(&dec, &c);
+        lap(&st->decode, &t);
+        st->bytes_in += c.bytes_in;
+        st->read_calls += c.read_calls;
+        st->values += c.values;
+        st->comment_bytes += c.comment_bytes;
+    }
+    unmap_input(&map);
+    rewind(f);
+    return cached;
+}
+
+/*
+ * The cache file for the input f: an existing one, else a new one filled
+ * from f. Returns NULL (f unread) if the input is not a regular file or
+ * cannot be cached.
+ */
+static FILE *cache_lookup(FILE *f, const struct options *opt, struct worker_buffers *wb,
+                          struct stats *st) {
+    char tag[128], path[4096];
+    struct stat st_in;
+    uint64_t h = 0xcbf29ce484222325ull;  /* FNV-1a of the tag names the file */
+
+    if (fstat(fileno(f), &st_in) != 0 || !S_ISREG(st_in.st_mode)) return NULL;
+    snprintf(tag, sizeof tag, "P6\n# gs-cache %llu %llu %llu %lld.%09ld\n",
+             (unsigned long long)st_in.st_dev, (unsigned long long)st_in.st_ino,
+             (unsigned long long)st_in.st_size, (long long)st_in.st_mtime,
+             (long)MTIME_NSEC(st_in));
+    for (const char *p = tag; *p; p++) h = (h ^ (unsigned char)*p) * 0x100000001b3ull;
+    if (snprintf(path, sizeof path, "%s/%016llx" CACHE_SUFFIX, opt->cache_dir,
+                 (unsigned long long)h) >= (int)sizeof path) {
+        return NULL;
+    }
+    FILE *cached = cache_open(path, tag);
+    return cached ? cached : cache_fill(f, path, tag, opt, wb, st);
+}
+#endif
+
+/*
+ * Converts one image. A path of "-" selects stdin or stdout. in_fd and
+ * out_fd, unless -1, are descriptors passed by a --serve client, which
+ * are used instead of the paths and closed; the paths then only name the
+ * image in messages. Errors are reported on stderr and a partially
+ * written output file is removed (with --checkpoint, kept up to the last
+ * checkpoint). Only the row buffers are held, so streaming through pipes
+ * needs no more memory than a file run (the --threads decoder excepted,
+ * which keeps the pixel data in memory). Phases and counters are added to
+ * st unless it is NULL. Returns 0 on success.
+ */
+static int convert_image(const char *in_path, const char *out_path, int in_fd, int out_fd,
+                         const struct options *opt, struct worker_buffers *wb, struct stats *st) {
+    FILE *input_file = NULL, *output_file = NULL;
+    unsigned char *slurp = NULL;
+    struct gs_decoder dec;
+    struct input_map map = { NULL, 0 };
+#ifdef HAVE_PTHREAD
+    struct pipeline pipe;
+    int piped = 0;
+#endif
+    int out_stream = out_fd >= 0 || strcmp(out_path, "-") == 0;  /* kept on error, not mapped */
+    int in_named = 0;   /* opened by path, so it can have an index or a cache entry */
+    int rc, ret = 1, decoding = 0, first_row = 0;
+    double t = st ? stats_now() : 0;
+#ifdef HAVE_INDEX
+    struct row_index ix;
+    int indexed = 0, indexable = 0, cached = 0;  /* cached: input is a --cache-dir file */
+    struct checkpoint ck;
+    int checkpointing = 0, resumed = 0;  /* resumed: continues from a checkpoint */
+    uint64_t out_pos = 0;                /* output offset, while checkpointing */
+#endif
+
+    worker_buffers_reset(wb);
+
+    /* Open input file in binary mode ("-" reads stdin). */
+    if (in_fd >= 0) {
+        if ((input_file = fdopen(in_fd, "rb")) == NULL) {
+            close(in_fd);
+            if (out_fd >= 0) close(out_fd);
+            report_error("Error: Cannot open input file '%s'\n", in_path);
+            return 1;
+        }
+    } else if (strcmp(in_path, "-") == 0) {
+        input_file = stdin;
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    } else if ((input_file = fopen(in_path, "rb")) == NULL) {
+        if (out_fd >= 0) close(out_fd);
+        report_error("Error: Cannot open input file '%s'\n", in_path);
+        return 1;
+    } else {
+        in_named = 1;
+    }
+
+#ifdef HAVE_MMAP
+    /* --cache-dir: read the raster decoded by an earlier run instead */
+    if (opt->cache_dir && in_named) {
+        if (st) lap(&st->open, &t);
+        FILE *blob = cache_lookup(input_file, opt, wb, st);
+        if (st) t = stats_now();  /* a fill books its own time */
+        if (blob) {
+            fclose(input_file);
+            input_file = blob;
+#ifdef HAVE_INDEX
+            cached = 1;
+#endif
+        }
+    }
+#endif
+
+#ifdef HAVE_INDEX
+    /* --checkpoint: continue after the rows an earlier run completed */
+    if (opt->checkpoint && in_named && !cached && !out_stream) {
+        int found = checkpoint_load(out_path, input_file, opt->conv, opt->out_format, &ck);
+        checkpointing = found >= 0;
+        resumed = found == 1;
+    }
+
+    /* --index: start at the first row needed, else record the rows as they are read */
+    uint64_t start = 0;
+    if (opt->use_index && in_named && !cached && !resumed) {
+        int found = index_load(in_path, input_file, &ix);
+        indexed = found == 1;
+        indexable = found >= 0;
+    }
+    if (resumed) {
+        first_row = (int)ck.rows;
+        start = ck.in_offset;
+    } else if (indexed) {
+        if (opt->crop_w > 0 && opt->crop_y < (int)ix.head.height) first_row = opt->crop_y;
+        start = index_row_offset(&ix, first_row);
+    }
+    if (resumed || indexed) {
+        if (fseeko(input_file, (off_t)start, SEEK_SET) != 0) {
+            report_error("Error: Cannot seek in input file '%s'\n", in_path);
+            goto cleanup;
+        }
+    }
+#endif
+
+    /* Decode straight from a mapping where possible, else in chunks via fread() */
+#ifdef HAVE_PTHREAD
+    if (opt->pipeline) {
+        piped = 1;
+        if (!pipeline_start_reader(&pipe, input_file)) {
+            report_error("Error: Cannot start pipeline reader\n");
+            goto cleanup;
+        }
+        gs_decoder_init_source(&dec, pipeline_next_chunk, &pipe);
+    } else
+#endif
+    if (opt->use_mmap && map_input(input_file, &map)) {
+#ifdef HAVE_INDEX
+        if (resumed || indexed) {
+            gs_decoder_init_mem(&dec, map.data + start, map.size - (size_t)start);
+        } else
+#endif
+        gs_decoder_init_mem(&dec, map.data, map.size);
+    } else {
+        if (wb->pix_buf == NULL &&
+            (wb->pix_buf = arena_alloc(&wb->arena, GS_CHUNK_SIZE)) == NULL) {
+            report_error("Error: Cannot allocate input buffer (%d bytes)\n", GS_CHUNK_SIZE);
+            goto cleanup;
+        }
+        gs_decoder_init_file(&dec, input_file, wb->pix_buf);
+    }
+    decoding = 1;
+    if (st) lap(&st->open, &t);
+
+    /* Parse and validate header - comments are allowed between all fields */
+#ifdef HAVE_INDEX
+    if (resumed) {
+        gs_decoder_resume(&dec, ck.format, ck.width, ck.height, ck.maxval, first_row);
+    } else if (indexed) {
+        gs_decoder_resume(&dec, ix.head.format, ix.head.width, ix.head.height, ix.head.maxval,
+                          first_row);
+    } else
+#endif
+    if ((rc = gs_read_header(&dec)) != GS_OK) {
+        report_decode_error(&dec, rc);
+        goto cleanup;
+    }
+    int width = dec.width, height = dec.height;
+    dec.trusted = opt->trusted;
+#ifdef HAVE_INDEX
+    if (indexable && !indexed) {
+        ix.head.format = dec.format;
+        ix.head.width = width;
+        ix.head.height = height;
+        ix.head.maxval = dec.maxval;
+        ix.head.data_offset = gs_decoder_offset(&dec);
+        if (dec.format == GS_FMT_P3) {
+            /* No index if the offsets do not fit in memory; it is only a shortcut */
+            ix.head.nrows = (uint64_t)height + 1;
+            ix.rows = malloc((size_t)ix.head.nrows * sizeof *ix.rows);
+            if (ix.rows == NULL) indexable = 0;
+            dec.row_offsets = ix.rows;
+        }
+    }
+#endif
+    if (st) lap(&st->header, &t);
+
+    /* --crop/--scale: the output covers the region, reduced by the scale */
+    int region = opt->crop_w > 0 || opt->scale_shift > 0;
+    int crop_x = 0, crop_y = 0, crop_w = width, crop_h = height;
+    if (opt->crop_w > 0) {
+        if (opt->crop_x > width - opt->crop_w || opt->crop_y > height - opt->crop_h) {
+            report_error("Error: Crop region %d,%d,%d,%d is outside the %dx%d image\n",
+                         opt->crop_x, opt->crop_y, opt->crop_w, opt->crop_h, width, height);
+            goto cleanup;
+        }
+        crop_x = opt->crop_x;
+        crop_y = opt->crop_y;
+        crop_w = opt->crop_w;
+        crop_h = opt->crop_h;
+    }
+    int out_w = (crop_w + (1 << opt->scale_shift) - 1) >> opt->scale_shift;
+    int out_h = (crop_h + (1 << opt->scale_shift) - 1) >> opt->scale_shift;
+    int in_w = region ? crop_w : width;  /* pixels decoded per row */
+
+    /* Any maxval but 255 takes the 16-bit row loop, which has no options of its own */
+    int wide = dec.maxval != 255;
+    if (wide && region) {
+        report_error("Error: --crop and --scale need maxval 255 input (got %d)\n", dec.maxval);
+        goto cleanup;
+    }
+    if (wide && opt->conv->kernel16 == NULL) {
+        report_error("Error: --linear and --gamma need maxval 255 input (got %d)\n",
+                     dec.maxval);
+        goto cleanup;
+    }
+    int out_maxval = wide && !opt->depth8 ? dec.maxval : 255;
+
+    /* Rows wider than a tile are streamed in tiles, as are all wide-sample rows */
+    int tiled = !region && (wide || in_w > TILE_PIXELS);
+    int tile_w = tiled && in_w > TILE_PIXELS ? TILE_PIXELS : in_w;
+
+#ifdef HAVE_INDEX
+    /* Only the plain row loop is checkpointed; other images convert as usual */
+    checkpointing = checkpointing && !wide && !tiled && !region;
+    if (checkpointing && !resumed) {
+        ck.format = dec.format;
+        ck.width = width;
+        ck.height = height;
+        ck.maxval = dec.maxval;
+        checkpoint_remove(out_path);  /* an old one does not describe the new output */
+    }
+    if (resumed) {
+        /* The rows before the checkpoint stay; the rest is written in place */
+        out_pos = ck.out_offset;
+        if ((output_file = fopen(out_path, "r+b")) == NULL) {
+            report_error("Error: Cannot open output file '%s'\n", out_path);
+            goto cleanup;
+        }
+        if (fseeko(output_file, (off_t)out_pos, SEEK_SET) != 0) {
+            report_error("Error: Cannot seek in output file '%s'\n", out_path);
+            goto cleanup;
+        }
+    } else
+#endif
+    if (out_fd >= 0) {
+        if ((output_file = fdopen(out_fd, "wb")) == NULL) {
+            close(out_fd);
+            report_error("Error: Cannot open output file '%s'\n", out_path);
+            goto cleanup;
+        }
+    } else if (out_stream) {
+        output_file = stdout;
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    } else if ((output_file = fopen(out_path, "wb")) == NULL) {
+        report_error("Error: Cannot open output file '%s'\n", out_path);
+        goto cleanup;
+    }
+    /* Attach output buffer for efficient writing */
+    if ((wb->out_buf = arena_alloc(&wb->arena, BUFFER_SIZE)) != NULL) {
+        setvbuf(output_file, wb->out_buf, _IOFBF, BUFFER_SIZE);
+    }
+
+    char header[64];
+    size_t header_len = gs_encode_header_maxval(header, sizeof header, opt->out_format, out_w,
+                                                out_h, out_maxval);
+
+    /* Allocate row buffer for one-write-per-row output */
+    size_t row_bytes = (size_t)tile_w * 3;  /* one RGB row (or tile), binary */
+    int row_w = tiled ? tile_w : out_w;
+    size_t row_cap = out_maxval == 255 ? gs_row_capacity(opt->out_format, row_w)
+                                       : gs_row_capacity16(opt->out_format, row_w);
+    if (!reserve(&wb->arena, &wb->row_buf, &wb->row_cap, row_cap)) {
+        report_error("Error: Cannot allocate row buffer (%zu bytes)\n", row_cap);
+        goto cleanup;
+    }
+    if (!reserve(&wb->arena, &wb->rgb_row, &wb->rgb_cap, row_bytes) ||
+        !reserve(&wb->arena, &wb->gray_row, &wb->gray_cap, (size_t)tile_w)) {
+        report_error("Error: Cannot allocate row buffer (%zu bytes)\n", row_bytes);
+        goto cleanup;
+    }
+    char *row_buf = wb->row_buf;
+    unsigned char *rgb_row = wb->rgb_row, *gray_row = wb->gray_row;
+    if (st) lap(&st->open, &t);
+
+    if (opt->exact_size && !region && !tiled && !(dec.format == GS_FMT_P3 && opt->nthreads > 1)) {
+        /* Convert the whole image first; the output is written in one go */
+        size_t plane_size = (size_t)width * height;
+        int rows = 0;
+        if (!reserve(&wb->arena, &wb->plane, &wb->plane_cap, plane_size)) {
+            report_error("Error: Cannot allocate gray plane (%zu bytes)\n", plane_size);
+            goto cleanup;
+        }
+        for (; rows < height; rows++) {
+            const unsigned char *rgb;
+            if ((rc = gs_read_row(&dec, rgb_row, &rgb)) != GS_OK) break;
+            if (st) lap(&st->decode, &t);
+            gs_convert_row(opt->conv, rgb, wb->plane + (size_t)rows * width, width);
+            if (st) lap(&st->convert, &t);
+        }
+        if (rc != GS_OK && !out_stream) {
+            report_decode_error(&dec, rc);
+            goto cleanup;
+        }
+        /* On stdout the rows before a decode error are written, as in the row loop */
+        size_t written = 0;
+        int wrc = write_exact(output_file, !out_stream, header, header_len, opt->out_format,
+                              wb->plane, width, rows, row_buf, &written);
+        if (st) {
+            lap(&st->write, &t);  /* the encoding is done in the output buffer */
+            if (wrc == 0) st->bytes_out += written;
+        }
+        if (rc != GS_OK) report_decode_error(&dec, rc);
+        ret = rc == GS_OK ? wrc : 1;
+        goto cleanup;
+    }
+
+#ifdef HAVE_INDEX
+    if (resumed) {
+        header_len = 0;  /* written by the run that made the checkpoint */
+    } else {
+        out_pos = header_len;
+    }
+#endif
+    if (fwrite(header, 1, header_len, output_file) != header_len) {
+        report_error("Error: Failed to write output header\n");
+        goto cleanup;
+    }
+    if (st) {
+        lap(&st->write, &t);
+        st->bytes_out += header_len;
+    }
+
+    if (wide) {
+        ret = convert_wide(&dec, opt, out_maxval, output_file, wb, st);
+        if (st) t = stats_now();  /* booked by the loop itself */
+        goto cleanup;
+    }
+    if (tiled) {
+        ret = convert_tiled(&dec, opt, output_file, wb, st);
+        if (st) t = stats_now();  /* booked by the loop itself */
+        goto cleanup;
+    }
+    if (region) {
+        ret = convert_region(&dec, opt, crop_x, crop_y, crop_w, crop_h, output_file, wb, st);
+        if (st) t = stats_now();  /* booked by the loop itself */
+        goto cleanup;
+    }
+
+#ifdef HAVE_PTHREAD
+    if (piped && !(dec.format == GS_FMT_P3 && opt->nthreads > 1)) {
+        size_t out_cap = row_cap > BUFFER_SIZE ? row_cap : BUFFER_SIZE;
+        /* From here on only the writer thread touches output_file */
+        if (!pipeline_start_writer(&pipe, output_file, out_cap)) {
+            report_error("Error: Cannot start pipeline writer\n");
+            goto cleanup;
+        }
+        if (convert_rows_pipelined(&pipe, &dec, opt, rgb_row, gray_row, row_cap, out_cap,
+                                   st) != 0) {
+            goto cleanup;
+        }
+        if (st) t = stats_now();  /* booked by the loop itself */
+        ret = 0;
+        goto cleanup;
+    }
+#ifdef HAVE_PREAD
+    if (dec.format == GS_FMT_P6 && opt->nthreads > 1 && !piped && !out_stream &&
+        (opt->out_format == GS_FMT_P6 || opt->out_format == GS_FMT_P5)) {
+        /* Fixed-size rows on both sides: strips go in parallel, each to its own offset */
+        struct stat in_st, out_st;
+        size_t held;
+        const unsigned char *data = gs_decoder_pending(&dec, &held);
+        int in_fd = fileno(input_file), out_fd = fileno(output_file);
+        off_t in_off = 0;
+        uint64_t len = held;
+        int ok = out_fd >= 0 && fstat(out_fd, &out_st) == 0 && S_ISREG(out_st.st_mode);
+        if (ok && map.data == NULL) {
+            off_t pos = ftello(input_file);  /* the decoder's chunk ends here */
+            ok = in_fd >= 0 && pos >= (off_t)held && fstat(in_fd, &in_st) == 0 &&
+                 S_ISREG(in_st.st_mode);
+            in_off = pos - (off_t)held;
+            len = ok && in_st.st_size > in_off ? (uint64_t)(in_st.st_size - in_off) : 0;
+            data = NULL;
+        }
+        if (ok) {
+            if (fflush(output_file) != 0) {  /* the header; the strips go to the fd */
+                report_error("Error: Failed to write output header\n");
+                goto cleanup;
+            }
+            if (convert_p6_strips(data, len, in_fd, in_off, width, height, opt->conv,
+                                  opt->out_format, opt->nthreads, out_fd, (off_t)header_len,
+                                  &wb->arena, st) != 0) {
+                goto cleanup;
+            }
+            if (st) t = stats_now();  /* booked by the loop itself */
+            ret = 0;
+            goto cleanup;
+        }
+    }
+#endif
+    if (dec.format == GS_FMT_P3 && opt->nthreads > 1) {
+        /* The parallel decoder needs the whole pixel region in memory */
+        size_t len, held;
+        const unsigned char *data = gs_decoder_pending(&dec, &held);
+        len = held;
+        if (map.data == NULL) {
+            slurp = piped ? pipeline_read_all(&pipe, data, len, &len)
+                          : read_all(input_file, data, len, &len);
+            if (slurp == NULL) {
+                report_error("Error: Cannot read input into memory\n");
+                goto cleanup;
+            }
+            data = slurp;
+            if (st) {
+                lap(&st->decode, &t);
+                st->bytes_in += len - held;  /* read past the decoder */
+            }
+        }
+        const uint64_t *row_off = NULL;
+#ifdef HAVE_INDEX
+        if (indexed) row_off = ix.rows;
+#endif
+        if (convert_p3_threaded(data, len, width, height, row_off, opt->conv, opt->out_format,
+                                opt->nthreads, opt->trusted, &wb->arena, output_file,
+                                st) != 0) {
+            goto cleanup;
+        }
+        if (st) t = stats_now();  /* booked by the decoder itself */
+        ret = 0;
+        goto cleanup;
+    }
+#endif
+
+#ifdef HAVE_WRITEV
+    if (opt->output_io != OUT_STDIO) {
+        struct row_sink sink;
+        if (fflush(output_file) != 0) {  /* the sink writes to the fd from here on */
+            report_error("Error: Failed to write output header\n");
+            goto cleanup;
+        }
+        if (!sink_open(&sink, output_file, opt->output_io, !out_stream, opt->out_format,
+                       height, row_cap, header_len)) {
+            sink_close(&sink);
+            report_error("Error: Cannot set up output backend\n");
+            goto cleanup;
+        }
+        for (int y = 0; y < height; y++) {
+            const unsigned char *rgb;
+            if ((rc = gs_read_row(&dec, rgb_row, &rgb)) != GS_OK) {
+                sink_flush(&sink);  /* rows before it, as the stdio loop */
+                report_decode_error(&dec, rc);
+                sink_close(&sink);
+                goto cleanup;
+            }
+            size_t pos = encode_row(opt, rgb, width, gray_row, sink_row(&sink), st, &t);
+            if (!sink_commit(&sink, pos)) {
+                report_error("Error: Write failure at row %d\n", sink.first_row);
+                sink_close(&sink);
+                goto cleanup;
+            }
+            if (st) lap(&st->write, &t);
+        }
+        if (!sink_flush(&sink)) {
+            report_error("Error: Write failure at row %d\n", sink.first_row);
+            sink_close(&sink);
+            goto cleanup;
+        }
+        sink_close(&sink);
+        if (st) lap(&st->write, &t);
+        ret = 0;
+        goto cleanup;
+    }
+#endif
+
+    /* Main loop: decode each row, convert, build the output row and write once */
+    for (int y = first_row; y < height; y++) {
+        const unsigned char *rgb;
+
+        if ((rc = gs_read_row(&dec, rgb_row, &rgb)) != GS_OK) {
+            report_decode_error(&dec, rc);
+            goto cleanup;
+        }
+
+        size_t pos = encode_row(opt, rgb, width, gray_row, row_buf, st, &t);
+
+        /*Write the row.*/
+        if (fwrite(row_buf, 1, pos, output_file) != pos) {
+            report_error("Error: Write failure at row %d\n", y);
+            goto cleanup;
+        }
+        if (st) lap(&st->write, &t);
+#ifdef HAVE_INDEX
+        out_pos += pos;
+        if (checkpointing && out_pos - ck.out_offset >= CHECKPOINT_BYTES && y + 1 < height) {
+            if (!checkpoint_save(output_file, out_path, &ck, (uint64_t)y + 1,
+                                 start + gs_decoder_offset(&dec), out_pos)) {
+                report_error("Error: Write failure at row %d\n", y);
+                goto cleanup;
+            }
+            if (st) lap(&st->write, &t);
+        }
+#endif
+    }
+#ifdef HAVE_INDEX
+    /* An earlier run may have written past the end of this output (P3 rows vary) */
+    if (resumed &&
+        (fflush(output_file) != 0 || ftruncate(fileno(output_file), (off_t)out_pos) != 0)) {
+        report_error("Error: Failed to write output file '%s'\n", out_path);
+        goto cleanup;
+    }
+#endif
+    
+    ret = 0;
+
+cleanup:
+    /* Clean up resources */
+#ifdef HAVE_INDEX
+    /*
+     * A new index needs every row's offset, so only a complete decode saves
+     * one; a --trusted decode may have split malformed rows differently.
+     */
+    if (ret == 0 && indexable && !indexed && !opt->trusted && dec.row == dec.height) {
+        if (ix.rows) ix.rows[dec.height] = gs_decoder_offset(&dec);
+        index_save(in_path, &ix);
+    }
+    if (indexable) index_free(&ix);
+#endif
+#ifdef HAVE_PTHREAD
+    if (piped) pipeline_stop(&pipe);
+#endif
+    unmap_input(&map);
+    if (input_file && fclose(input_file) != 0 && ret == 0) {
+        report_error("Warning: Error closing input file\n");
+        ret = 1;
+    }
+    if (output_file) {
+        if (fclose(output_file) != 0 && ret == 0) {
+            report_error("Error: Failed to close output file properly\n");
+            ret = 1;
+        }
+#ifdef HAVE_INDEX
+        if (checkpointing && ret == 0) {
+            checkpoint_remove(out_path);
+        } else if (checkpointing && ck.rows > 0) {
+            /* Keep the rows up to the checkpoint for the next run */
+            report_error("Kept rows 0-%llu of '%s'; rerun to resume at row %llu\n",
+                         (unsigned long long)ck.rows - 1, out_path,
+                         (unsigned long long)ck.rows);
+        } else
+#endif
+        if (ret != 0 && !out_stream) {
+            remove(out_path);  /* Clean up partial output on error */
+        }
+    } else if (out_fd >= 0) {
+        close(out_fd);
+    }
+    if (st) {
+        lap(&st->write, &t);  /* fclose() flushes the last buffer */
+        if (wb->arena.demand > st->arena_peak) st->arena_peak = wb->arena.demand;
+        st->images++;
+        st->failed += ret != 0;
+        if (decoding) {
+            struct gs_counters c;
+            gs_decoder_counters(&dec, &c);
+            st->rows += (uint64_t)(dec.row - first_row);
+            st->bytes_in += c.bytes_in;
+            st->read_calls += c.read_calls;
+            st->values += c.values;
+            st->comment_bytes += c.comment_bytes;
+        }
+    }
+
+    free(slurp);
+    return ret;
+}
+
+/* Growable list of owned strings. */
+struct path_list {
+    char **items;
+    size_t count, cap;
+};
+
+static int path_list_push(struct path_list *l, const char *path) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        char **grown = realloc(l->items, cap * sizeof *grown);
+        if (grown == NULL) return 0;
+        l->items = grown;
+        l->cap = cap;
+    }
+    char *copy = path ? malloc(strlen(path) + 1) : NULL;
+    if (path && copy == NULL) return 0;
+    if (copy) strcpy(copy, path);
+    l->items[l->count++] = copy;
+    return 1;
+}
+
+static void path_list_free(struct path_list *l) {
+    for (size_t i = 0; i < l->count; i++) free(l->items[i]);
+    free(l->items);
+    memset(l, 0, sizeof *l);
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Does name end in ".ppm" (any case)? */
+static int has_ppm_suffix(const char *name) {
+    size_t n = strlen(name);
+    if (n < 4) return 0;
+    const char *e = name + n - 4;
+    return e[0] == '.' && tolower((unsigned char)e[1]) == 'p' &&
+           tolower((unsigned char)e[2]) == 'p' && tolower((unsigned char)e[3]) == 'm';
+}
+
+/*
+ * Adds one batch argument to inputs (outputs gets a matching NULL: derive
+ * the name). A directory contributes its *.ppm files (except our own
+ * "*-gray.ppm" outputs, so reruns are idempotent) and an argument with
+ * wildcards is expanded with glob(), both in sorted order; anything else
+ * is taken as a file name. Returns 0 on allocation failure.
+ */
+static int add_batch_input(struct path_list *inputs, struct path_list *outputs, const char *arg) {
+#ifdef HAVE_DIRENT
+    struct stat st;
+    if (stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(arg);
+        struct dirent *de;
+        size_t first = inputs->count;
+        if (dir == NULL) {
+            report_error("Error: Cannot open directory '%s'\n", arg);
+            return 1;
+        }
+        while ((de = readdir(dir)) != NULL) {
+            size_t nlen = strlen(de->d_name);
+            if (!has_ppm_suffix(de->d_name) ||
+                (nlen >= 9 && strcmp(de->d_name + nlen - 9, "-gray.ppm") == 0)) {
+                continue;
+            }
+            size_t len = strlen(arg) + strlen(de->d_name) + 2;
+            char *path = malloc(len);
+            if (path == NULL) break;
+            snprintf(path, len, "%s/%s", arg, de->d_name);
+            int ok = path_list_push(inputs, path) && path_list_push(outputs, NULL);
+            free(path);
+            if (!ok) {
+                closedir(dir);
+                return 0;
+            }
+        }
+        closedir(dir);
+        qsort(inputs->items + first, inputs->count - first, sizeof(char *), compare_paths);
+        return 1;
+    }
+    if (strpbrk(arg, "*?[") != NULL) {
+        glob_t g;
+        int rc = glob(arg, 0, NULL, &g);  /* glob() sorts its results */
+        if (rc == 0) {
+            for (size_t i = 0; i < g.gl_pathc; i++) {
+                if (!path_list_push(inputs, g.gl_pathv[i]) || !path_list_push(outputs, NULL)) {
+                    globfree(&g);
+                    return 0;
+                }
+            }
+            globfree(&g);
+            return 1;
+        }
+        if (rc != GLOB_NOMATCH) return 0;
+        /* no match: fall through and let the open fail with its usual message */
+    }
+#endif
+    return path_list_push(inputs, arg) && path_list_push(outputs, NULL);
+}
+
+/*
+ * Reads a manifest: one input path per line, optionally followed by a tab
+ * and the output path. Blank lines and lines starting with '#' are skipped.
+ * Returns 0 if the file cannot be read.
+ */
+static int read_manifest(const char *path, struct path_list *inputs, struct path_list *outputs) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[4096];
+    int ok = 1;
+
+    if (f == NULL) {
+        report_error("Error: Cannot open manifest '%s'\n", path);
+        return 0;
+    }
+    while (ok && fgets(line, sizeof line, f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        char *tab = strchr(line, '\t');
+        if (tab) *tab++ = '\0';
+        ok = path_list_push(inputs, line) && path_list_push(outputs, tab && *tab ? tab : NULL);
+    }
+    if (ferror(f)) ok = 0;
+    if (f != stdin) fclose(f);
+    if (!ok) report_error("Error: Failed to read manifest '%s'\n", path);
+    return ok;
+}
+
+/*
+ * Output name for a batch input: "dir/name.ppm" -> "dir/name-gray.ppm",
+ * or "out_dir/name-gray.ppm" with --out-dir. PGM output uses ".pgm".
+ */
+static char *batch_output_path(const char *in, const char *out_dir, int out_format) {
+    const char *base = strrchr(in, '/');
+#ifdef _WIN32
+    const char *bs = strrchr(in, '\\');
+    if (bs && (!base || bs > base)) base = bs;
+#endif
+    base = base ? base + 1 : in;
+    const char *dot = strrchr(base, '.');
+    size_t stem = dot && dot != base ? (size_t)(dot - in) : strlen(in);
+    const char *ext = out_format == GS_FMT_P2 || out_format == GS_FMT_P5 ? ".pgm" : ".ppm";
+    const char *dir = out_dir ? out_dir : "";
+    const char *sep = out_dir ? "/" : "";
+
+    if (out_dir) {  /* keep only the file name */
+        stem -= (size_t)(base - in);
+        in = base;
+    }
+    size_t len = strlen(dir) + 1 + stem + strlen("-gray") + strlen(ext) + 1;
+    char *out = malloc(len);
+    if (out) snprintf(out, len, "%s%s%.*s-gray%s", dir, sep, (int)stem, in, ext);
+    return out;
+}
+
+/* Shared work queue of a batch run. */
+struct batch {
+    const struct path_list *inputs, *outputs;
+    const char *out_dir;
+    const struct options *opt;
+    struct stats *stats;    /* --stats totals, or NULL */
+    size_t next;            /* next input to hand out */
+    size_t failed;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+static void batch_lock(struct batch *b) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&b->lock);
+#else
+    (void)b;
+#endif
+}
+
+static void batch_unlock(struct batch *b) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&b->lock);
+#else
+    (void)b;
+#endif
+}
+
+/*
+ * Pool worker: takes inputs off the queue until it is empty. A failing
+ * image is reported and counted; the rest of the batch carries on.
+ */
+static void *batch_worker(void *arg) {
+    struct batch *b = *(struct batch **)arg;
+    struct worker_buffers wb;
+    struct stats st;
+
+    worker_buffers_init(&wb, b->opt->arena_max);
+    memset(&st, 0, sizeof st);
+    for (;;) {
+        batch_lock(b);
+        size_t i = b->next++;
+        batch_unlock(b);
+        if (i >= b->inputs->count) break;
+
+        const char *in = b->inputs->items[i];
+        char *derived = NULL;
+        const char *out = b->outputs->items[i];
+        if (out == NULL) out = derived = batch_output_path(in, b->out_dir, b->opt->out_format);
+
+        int rc = 1;
+        current_input = in;
+        if (out == NULL) report_error("Error: Cannot allocate output path\n");
+        else rc = convert_image(in, out, -1, -1, b->opt, &wb, b->stats ? &st : NULL);
+        current_input = NULL;
+
+        batch_lock(b);
+        if (rc == 0) printf("OK %s -> %s\n", in, out);
+        else printf("FAIL %s\n", in);
+        b->failed += rc != 0;
+        batch_unlock(b);
+        free(derived);
+    }
+    if (b->stats) {
+        batch_lock(b);
+        stats_add(b->stats, &st);
+        batch_unlock(b);
+    }
+    worker_buffers_free(&wb);
+    return NULL;
+}
+
+/*
+ * Converts every input across opt->nthreads workers, each decoding its
+ * images serially with its own reused buffers. Prints one OK/FAIL line per
+ * image on stdout and a summary on stderr. Per-image stats are summed into
+ * st unless it is NULL. Returns 0 if all succeeded.
+ */
+static int run_batch(const struct path_list *inputs, const struct path_list *outputs,
+                     const char *out_dir, const struct options *opt, struct stats *st) {
+    struct options one = *opt;
+    struct batch b;
+    struct batch *jobs[MAX_THREADS];
+    int nworkers = opt->nthreads;
+
+    one.nthreads = 1;  /* parallelism comes from the pool, not within an image */
+    memset(&b, 0, sizeof b);
+    b.inputs = inputs;
+    b.outputs = outputs;
+    b.out_dir = out_dir;
+    b.opt = &one;
+    b.stats = st;
+    if ((size_t)nworkers > inputs->count) nworkers = inputs->count ? (int)inputs->count : 1;
+    for (int t = 0; t < nworkers; t++) jobs[t] = &b;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&b.lock, NULL);
+    run_parallel(batch_worker, jobs, sizeof jobs[0], nworkers);
+    pthread_mutex_destroy(&b.lock);
+#else
+    batch_worker(&jobs[0]);
+#endif
+    fflush(stdout);
+    fprintf(stderr, "%zu converted, %zu failed\n", inputs->count - b.failed, b.failed);
+    return b.failed != 0;
+}
+
+#ifdef HAVE_SERVE
+/*
+ * --serve: a long-running converter for an orchestrator that would
+ * otherwise start the binary per job. A pool of opt->nthreads workers is
+ * started once; each keeps its buffers (and the shared converter tables)
+ * warm across requests, so a small image costs the conversion and little
+ * else. Requests are lines:
+ *
+ *   INPUT[<tab>OUTPUT]   convert by path, as a --manifest line
+ *   @NAME                convert the two descriptors (input, then output)
+ *                        sent with the line as SCM_RIGHTS; NAME only labels
+ *                        the reply
+ *
+ * and each gets one reply line: "OK INPUT -> OUTPUT" (or "OK @NAME"), or
+ * "FAIL INPUT: message" with the first error message of the request.
+ * Requests come from stdin, with the replies on stdout, or from
+ * connections to a Unix socket, where each worker accepts a connection
+ * and serves its requests in order until the client hangs up or the
+ * server is stopped.
+ */
+struct server {
+    const struct options *opt;
+    const char *out_dir;
+    struct stats *stats;    /* --stats totals, or NULL */
+    int listen_fd;          /* -1: requests on stdin */
+    int stop_fd;            /* readable once SIGINT/SIGTERM arrived, or -1 */
+    pthread_mutex_t lock;   /* stdin, stdout and the totals */
+};
+
+/* Converts the request in line (fds: descriptors sent with it) and formats its reply. */
+static void serve_request(const struct server *s, char *line, int *fds, int nfds,
+                          struct worker_buffers *wb, struct stats *st, char *reply, size_t cap) {
+    char error[1024] = "";
+    char *derived = NULL;
+    const char *in = line, *out = NULL;
+    int rc = 1;
+
+    first_error = error;
+    current_input = in;
+    if (line[0] == '@') {
+        if (nfds == 2) {
+            rc = convert_image(in, in, fds[0], fds[1], s->opt, wb, st);
+            nfds = 0;
+        } else {
+            report_error("Error: Request needs an input and an output descriptor (got %d)\n",
+                         nfds);
+        }
+    } else {
+        char *tab = strchr(line, '\t');
+        if (tab) *tab++ = '\0';
+        out = tab && *tab ? tab : (derived = batch_output_path(in, s->out_dir, s->opt->out_format));
+        if (out == NULL) {
+            report_error("Error: Cannot allocate output path\n");
+        } else if (strcmp(in, "-") == 0 || strcmp(out, "-") == 0) {
+            report_error("Error: --serve requests take file paths or descriptors, not '-'\n");
+        } else {
+            rc = convert_image(in, out, -1, -1, s->opt, wb, st);
+        }
+    }
+    current_input = NULL;
+    first_error = NULL;
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+
+    error[strcspn(error, "\n")] = '\0';
+    if (rc == 0 && out) snprintf(reply, cap, "OK %s -> %s\n", in, out);
+    else if (rc == 0) snprintf(reply, cap, "OK %s\n", in);
+    else snprintf(reply, cap, "FAIL %s: %s\n", in, error);
+    free(derived);
+}
+
+/*
+ * Waits until fd is readable. Returns 0 instead once the server is being
+ * stopped, which takes precedence over pending input.
+ */
+static int serve_wait(const struct server *s, int fd) {
+    struct pollfd p[2] = { { fd, POLLIN, 0 }, { s->stop_fd, POLLIN, 0 } };
+
+    for (;;) {
+        int n = poll(p, s->stop_fd >= 0 ? 2 : 1, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || (s->stop_fd >= 0 && p[1].revents)) return 0;
+        if (p[0].revents) return 1;
+    }
+}
+
+/*
+ * Serves one connection: reads request lines, queueing the descriptors
+ * that arrive with them, and writes a reply per request. Once the server
+ * is stopped, the requests already received are finished and the rest
+ * of the connection is dropped.
+ */
+static void serve_connection(const struct server *s, int conn, struct worker_buffers *wb,
+                             struct stats *st) {
+    char buf[SERVE_LINE_MAX], reply[SERVE_LINE_MAX + 1200];
+    size_t len = 0;
+    int fds[SERVE_MAX_FDS], nfds = 0;
+
+    for (;;) {
+        union {
+            struct cmsghdr hdr;
+            char space[CMSG_SPACE(sizeof(int) * SERVE_MAX_FDS)];
+        } control;
+        struct iovec iov = { buf + len, sizeof buf - len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof control.space;
+
+        if (!serve_wait(s, conn)) break;
+        ssize_t k = recvmsg(conn, &msg, 0);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) break;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+            int n = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < n; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof fd);
+                if (nfds < SERVE_MAX_FDS) fds[nfds++] = fd;
+                else close(fd);
+            }
+        }
+        len += (size_t)k;
+
+        char *line = buf, *nl;
+        while ((nl = memchr(line, '\n', len - (size_t)(line - buf))) != NULL) {
+            *nl = '\0';
+            if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+            if (line[0] != '\0' && line[0] != '#') {
+                int take = line[0] == '@' ? (nfds < 2 ? nfds : 2) : 0;
+                serve_request(s, line, fds, take, wb, st, reply, sizeof reply);
+                nfds -= take;
+                memmove(fds, fds + take, (size_t)nfds * sizeof fds[0]);
+                struct iovec out = { reply, strlen(reply) };
+                if (!write_iov(conn, &out, 1, 0)) goto done;
+            }
+            line = nl + 1;
+        }
+        len -= (size_t)(line - buf);
+        memmove(buf, line, len);
+        if (len == sizeof buf) {
+            static const char too_long[] = "FAIL -: Error: Request line too long\n";
+            struct iovec out = { (void *)too_long, sizeof too_long - 1 };
+            write_iov(conn, &out, 1, 0);
+            break;
+        }
+    }
+done:
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+}
+
+static void *serve_worker(void *arg) {
+    struct server *s = *(struct server **)arg;
+    struct worker_buffers wb;
+    struct stats st;
+    char line[SERVE_LINE_MAX], reply[SERVE_LINE_MAX + 1200];
+
+    worker_buffers_init(&wb, s->opt->arena_max);
+    memset(&st, 0, sizeof st);
+    for (;;) {
+        if (s->listen_fd >= 0) {
+            if (!serve_wait(s, s->listen_fd)) break;
+            int conn = accept(s->listen_fd, NULL, NULL);
+            /* EAGAIN: another worker took the connection */
+            if (conn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                             errno == ECONNABORTED)) {
+                continue;
+            }
+            if (conn < 0) break;
+            fcntl(conn, F_SETFL, 0);  /* BSDs pass O_NONBLOCK on from the listener */
+            serve_connection(s, conn, &wb, s->stats ? &st : NULL);
+            close(conn);
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        char *got = fgets(line, sizeof line, stdin);
+        pthread_mutex_unlock(&s->lock);
+        if (got == NULL) break;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        serve_request(s, line, NULL, 0, &wb, s->stats ? &st : NULL, reply, sizeof reply);
+        pthread_mutex_lock(&s->lock);
+        fputs(reply, stdout);
+        fflush(stdout);
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (s->stats) {
+        pthread_mutex_lock(&s->lock);
+        stats_add(s->stats, &st);
+        pthread_mutex_unlock(&s->lock);
+    }
+    worker_buffers_free(&wb);
+    return NULL;
+}
+
+/*
+ * Listens on the Unix socket path. A socket file left by a server that
+ * is gone is replaced; one that still accepts connections is an error.
+ * Returns the listening descriptor, or -1.
+ */
+static int serve_listen(const char *path) {
+    struct sockaddr_un addr;
+    struct stat sb;
+    int fd;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        report_error("Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        report_error("Error: Cannot create socket\n");
+        return -1;
+    }
+    if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+            report_error("Error: '%s' is already being served\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) != 0 || listen(fd, SOMAXCONN) != 0) {
+        report_error("Error: Cannot listen on '%s'\n", path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);  /* the workers poll it; only one wins each accept() */
+    return fd;
+}
+
+static volatile sig_atomic_t serve_stop_fd = -1;
+
+/*
+ * SIGINT/SIGTERM: makes the stop pipe readable. Every worker polls it
+ * with the socket or connection it waits on, so each one finishes the
+ * request in progress and returns, idle connections included; the server
+ * then prints its statistics and removes the socket file.
+ */
+static void serve_stop(int sig) {
+    (void)sig;
+    if (serve_stop_fd >= 0) {
+        ssize_t n = write(serve_stop_fd, "", 1);
+        (void)n;
+    }
+}
+
+/*
+ * Runs the server on the socket path ("-": stdin/stdout) with
+ * opt->nthreads workers. Returns at the end of stdin; on a socket it
+ * serves until SIGINT or SIGTERM. Returns 0 unless it cannot start.
+ */
+static int run_server(const char *path, const char *out_dir, const struct options *opt,
+                      struct stats *st) {
+    struct options one = *opt;
+    struct server s;
+    struct server *jobs[MAX_THREADS];
+
+    one.nthreads = 1;  /* parallelism comes from the pool, not within an image */
+    memset(&s, 0, sizeof s);
+    s.opt = &one;
+    s.out_dir = out_dir;
+    s.stats = st;
+    s.listen_fd = -1;
+    s.stop_fd = -1;
+    signal(SIGPIPE, SIG_IGN);  /* a client that hangs up only ends its connection */
+    if (strcmp(path, "-") != 0) {
+        struct sigaction sa;
+        int stop[2];
+        if ((s.listen_fd = serve_listen(path)) < 0) return 1;
+        if (pipe(stop) != 0) {
+            report_error("Error: Cannot create stop pipe\n");
+            close(s.listen_fd);
+            unlink(path);
+            return 1;
+        }
+        fcntl(stop[1], F_SETFL, O_NONBLOCK);  /* a signal never blocks in the handler */
+        s.stop_fd = stop[0];
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = serve_stop;
+        sigemptyset(&sa.sa_mask);
+        serve_stop_fd = stop[1];
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
+    for (int t = 0; t < opt->nthreads; t++) jobs[t] = &s;
+
+    pthread_mutex_init(&s.lock, NULL);
+    run_parallel(serve_worker, jobs, sizeof jobs[0], opt->nthreads);
+    pthread_mutex_destroy(&s.lock);
+    if (s.listen_fd >= 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        close(serve_stop_fd);
+        serve_stop_fd = -1;
+        close(s.stop_fd);
+        close(s.listen_fd);
+        unlink(path);
+    }
+    fflush(stdout);
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv) {
+    static struct gs_converter conv;    /* ~68 KiB of tables, shared by all workers */
+    struct options opt = { &conv, GS_FMT_P3, 1, 0, OUT_STDIO, 0, -1, 0, 0, 0, 0, 0, 0, 0, NULL,
+                           (size_t)ARENA_DEFAULT_MAX << 20, 0, 0 };
+    const char *paths[2] = { INPUT_FILE, OUTPUT_FILE };
+    int npaths = 0;     /* positional arguments, compacted to argv[0..npaths) */
+    int batch = 0;
+    const char *manifest = NULL, *out_dir = NULL, *serve_path = NULL;
+    struct path_list inputs = { NULL, 0, 0 }, outputs = { NULL, 0, 0 };
+    const char *prog = argv[0];
+    int use_simd = 1;
+    int gray_mode = GS_MODE_AVERAGE;
+    double weights[3] = { 1, 1, 1 };
+    int linear_light = 0;
+    double gamma = 1.0;
+    int stats_mode = 0;     /* --stats: 1 text, 2 JSON */
+    struct stats stats;
+    uint64_t sys_r0 = 0, sys_w0 = 0;
+    double t0 = stats_now();
+
+    for (int i = 1; i < argc; i++) {
+        const char *val;
+        if (match_option(argc, argv, &i, "-f", "--format", &val)) {
+            if ((opt.out_format = parse_format(val)) < 0) {
+                fprintf(stderr, "Error: Unknown output format '%s'\n", val);
+                return 1;
+            }
+        } else if (match_option(argc, argv, &i, "-t", "--threads", &val)) {
+            char *endp;
+            long n = strtol(val, &endp, 10);
+            if (*val == '\0' || *endp != '\0' || n < 0 || n > MAX_THREADS) {
+                fprintf(stderr, "Error: Thread count must be 0-%d\n", MAX_THREADS);
+                return 1;
+            }
+            opt.nthreads = (int)n;
+        } else if (match_option(argc, argv, &i, "-m", "--mode", &val)) {
+            if (strcmp(val, "average") == 0) gray_mode = GS_MODE_AVERAGE;
+            else if (strcmp(val, "bt601") == 0) gray_mode = GS_MODE_BT601;
+            else if (strcmp(val, "bt709") == 0) gray_mode = GS_MODE_BT709;
+            else {
+                fprintf(stderr, "Error: Unknown grayscale mode '%s'\n", val);
+                return 1;
+            }
+        } else if (match_option(argc, argv, &i, "-w", "--weights", &val)) {
+            char tail;
+            if (sscanf(val, "%lf,%lf,%lf%c", &weights[0], &weights[1], &weights[2], &tail) != 3 ||
+                gs_converter_init(&conv, GS_MODE_CUSTOM, weights, 0, 1.0) != GS_OK) {
+                fprintf(stderr, "Error: Weights must be three non-negative numbers 'R,G,B'\n");
+                return 1;
+            }
+            gray_mode = GS_MODE_CUSTOM;
+        } else if (match_option(argc, argv, &i, "-g", "--gamma", &val)) {
+            char *endp;
+            gamma = strtod(val, &endp);
+            if (*val == '\0' || *endp != '\0' || !(gamma > 0) || gamma > 100) {
+                fprintf(stderr, "Error: Gamma must be a number in (0, 100]\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--linear") == 0) {
+            linear_light = 1;
+        } else if (strcmp(argv[i], "--no-mmap") == 0) {
+            opt.use_mmap = 0;
+        } else if (match_option(argc, argv, &i, NULL, "--output-io", &val)) {
+            static const char *const names[] = { "stdio", "writev", "vmsplice", "mmap", "auto" };
+            int k = 0;
+            while (k <= OUT_AUTO && strcmp(val, names[k]) != 0) k++;
+            if (k > OUT_AUTO) {
+                fprintf(stderr, "Error: Unknown output backend '%s'\n", val);
+                return 1;
+            }
+            opt.output_io = k;
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            stats_mode = 1;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats_mode = 2;
+        } else if (match_option(argc, argv, &i, NULL, "--crop", &val)) {
+            char tail;
+            if (sscanf(val, "%d,%d,%d,%d%c", &opt.crop_x, &opt.crop_y, &opt.crop_w,
+                       &opt.crop_h, &tail) != 4 ||
+                opt.crop_x < 0 || opt.crop_y < 0 || opt.crop_w < 1 || opt.crop_h < 1) {
+                fprintf(stderr, "Error: Crop must be 'X,Y,W,H' with W and H at least 1\n");
+                return 1;
+            }
+        } else if (match_option(argc, argv, &i, NULL, "--scale", &val)) {
+            if (strcmp(val, "1/1") == 0) opt.scale_shift = 0;
+            else if (strcmp(val, "1/2") == 0) opt.scale_shift = 1;
+            else if (strcmp(val, "1/4") == 0) opt.scale_shift = 2;
+            else if (strcmp(val, "1/8") == 0) opt.scale_shift = 3;
+            else {
+                fprintf(stderr, "Error: Scale must be 1/2, 1/4 or 1/8\n");
+                return 1;
+            }
+        } else if (match_option(argc, argv, &i, NULL, "--depth", &val)) {
+            if (strcmp(val, "8") != 0) {
+                fprintf(stderr, "Error: Depth must be 8\n");
+                return 1;
+            }
+            opt.depth8 = 1;
+        } else if (strcmp(argv[i], "--exact-size") == 0) {
+            opt.exact_size = 1;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            opt.use_index = 1;
+        } else if (strcmp(argv[i], "--trusted") == 0) {
+            opt.trusted = 1;
+        } else if (strcmp(argv[i], "--checkpoint") == 0) {
+#ifndef HAVE_INDEX
+            fprintf(stderr, "Error: --checkpoint is not supported on this platform\n");
+            return 1;
+#endif
+            opt.checkpoint = 1;
+        } else if (match_option(argc, argv, &i, NULL, "--cache-dir", &val)) {
+#ifdef HAVE_MMAP
+            struct stat dir;
+            if (stat(val, &dir) != 0 || !S_ISDIR(dir.st_mode)) {
+                fprintf(stderr, "Error: Cache directory '%s' does not exist\n", val);
+                return 1;
+            }
+            opt.cache_dir = val;
+#else
+            fprintf(stderr, "Error: --cache-dir needs mmap support\n");
+            return 1;
+#endif
+        } else if (match_option(argc, argv, &i, NULL, "--arena-max", &val)) {
+            char *endp;
+            long mib = strtol(val, &endp, 10);
+            if (*val == '\0' || *endp != '\0' || mib < 0 || (unsigned long)mib > SIZE_MAX >> 21) {
+                fprintf(stderr, "Error: Arena size must be a number of MiB\n");
+                return 1;
+            }
+            opt.arena_max = (size_t)mib << 20;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            opt.pipeline = 1;
+        } else if (strcmp(argv[i], "--no-simd") == 0) {
+            use_simd = 0;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if (match_option(argc, argv, &i, NULL, "--manifest", &val)) {
+            manifest = val;
+            batch = 1;
+        } else if (match_option(argc, argv, &i, NULL, "--out-dir", &val)) {
+            out_dir = val;
+        } else if (match_option(argc, argv, &i, NULL, "--serve", &val)) {
+#ifndef HAVE_SERVE
+            fprintf(stderr, "Error: --serve is not supported on this platform\n");
+            return 1;
+#endif
+            serve_path = val;
+        } else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+            argv[npaths++] = argv[i];  /* npaths <= i: already consumed */
+        } else {
+            usage(prog);
+            return 1;
+        }
+    }
+
+    gs_init(use_simd ? 0 : GS_INIT_NO_SIMD);
+    gs_converter_init(&conv, gray_mode, weights, linear_light, gamma);  /* arguments checked above */
+
+    /* batch and --serve default to all CPUs */
+    if (opt.nthreads < 0) opt.nthreads = batch || serve_path ? 0 : 1;
+    if (opt.nthreads == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        opt.nthreads = ncpu < 1 ? 1 : ncpu > MAX_THREADS ? MAX_THREADS : (int)ncpu;
+#else
+        opt.nthreads = 1;
+#endif
+    }
+
+    /* The checkpointed loop is the plain one: one thread, stdio, row by row */
+    if (opt.checkpoint && ((opt.nthreads > 1 && !batch && !serve_path) || opt.pipeline ||
+                           opt.output_io != OUT_STDIO || opt.exact_size || opt.crop_w > 0 ||
+                           opt.scale_shift > 0 || opt.cache_dir)) {
+        fprintf(stderr, "Error: --checkpoint cannot be combined with --threads, --pipeline, "
+                "--output-io, --exact-size, --crop, --scale or --cache-dir\n");
+        return 1;
+    }
+
+    memset(&stats, 0, sizeof stats);
+    int have_syscalls = stats_mode && io_syscalls(&sys_r0, &sys_w0);
+    struct stats *st = stats_mode ? &stats : NULL;
+    int ret = 1;
+
+    if (serve_path) {
+#ifdef HAVE_SERVE
+        if (batch || npaths > 0) {
+            usage(prog);
+            return 1;
+        }
+        ret = run_server(serve_path, out_dir, &opt, st);
+#endif
+    } else if (batch) {
+        int ok = manifest == NULL || read_manifest(manifest, &inputs, &outputs);
+        for (int i = 0; ok && i < npaths; i++) {
+            if (!add_batch_input(&inputs, &outputs, argv[i])) {
+                report_error("Error: Out of memory collecting batch inputs\n");
+                ok = 0;
+            }
+        }
+        ret = ok ? run_batch(&inputs, &outputs, out_dir, &opt, st) : 1;
+        path_list_free(&inputs);
+        path_list_free(&outputs);
+    } else {
+        if (npaths > 2) {
+            usage(prog);
+            return 1;
+        }
+        for (int i = 0; i < npaths; i++) paths[i] = argv[i];
+
+        struct worker_buffers wb;
+        worker_buffers_init(&wb, opt.arena_max);
+        ret = convert_image(paths[0], paths[1], -1, -1, &opt, &wb, st);
+        worker_buffers_free(&wb);
+    }
+
+    if (stats_mode) {
+        uint64_t sys_r = 0, sys_w = 0;
+        int known = have_syscalls && io_syscalls(&sys_r, &sys_w);
+        print_stats(&stats, stats_now() - t0, known ? (long long)(sys_r - sys_r0) : -1,
+                    known ? (long long)(sys_w - sys_w0) : -1, peak_rss(), stats_mode == 2);
+    }
+    return ret;
+}
+
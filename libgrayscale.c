@@ -0,0 +1,1444 @@
+/*
+ * libgrayscale - PPM (P3/P6) decoding, grayscale conversion and P3/P6/P2/P5
+ * encoding. See libgrayscale.h for the API; grayscale.c is the command-line
+ * front end.
+ */
+
+#include "libgrayscale.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#include <immintrin.h>
+#define HAVE_SIMD_X86 1
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_SIMD_NEON 1
+#endif
+
+static const char *const format_magic[] = { "P3", "P6", "P2", "P5" };
+
+/* Character classes used by the pixel-data tokenizer. */
+enum { CC_OTHER = 0, CC_SPACE, CC_DIGIT, CC_COMMENT };
+
+/*
+ * 256-entry class table. Matches isspace()/isdigit() in the "C" locale
+ * without the per-call locale lookup.
+ */
+static const unsigned char char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT,
+    ['4'] = CC_DIGIT, ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT,
+    ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+    ['#'] = CC_COMMENT,
+};
+
+/*
+ * Block reader (struct gs_reader). A file is pulled in GS_CHUNK_SIZE
+ * chunks with fread() and scanned with a plain pointer, so the hot loop
+ * never goes through stdio once per byte; a memory span is scanned in
+ * place.
+ */
+static void reader_init(struct gs_reader *rd, FILE *f, unsigned char *buf) {
+    memset(rd, 0, sizeof *rd);
+    rd->f = f;
+    rd->buf = buf;
+    rd->pos = buf;
+    rd->end = buf;
+}
+
+/* Attaches the reader to an in-memory span (e.g. a mapped file); no refills. */
+static void reader_init_span(struct gs_reader *rd, const unsigned char *data, size_t len) {
+    memset(rd, 0, sizeof *rd);
+    rd->pos = data;
+    rd->end = data + len;
+    rd->count.bytes_in = len;
+}
+
+/* Loads the next chunk. Returns 0 at EOF or on read error. */
+static int reader_refill(struct gs_reader *rd) {
+    size_t n;
+
+    if (rd->next) {
+        const unsigned char *chunk = NULL;
+        n = rd->next(rd->ctx, &chunk);
+        rd->pos = chunk;
+        rd->end = n ? chunk + n : chunk;
+        rd->count.bytes_in += n;
+        rd->count.read_calls += n != 0;
+        return n != 0;
+    }
+    if (rd->f == NULL) {
+        rd->pos = rd->end;  /* span reader: the whole input is already visible */
+        return 0;
+    }
+    n = fread(rd->buf, 1, GS_CHUNK_SIZE, rd->f);
+    rd->pos = rd->buf;
+    rd->end = rd->buf + n;
+    rd->count.bytes_in += n;
+    rd->count.read_calls++;
+    return n != 0;
+}
+
+/* Next byte, or -1 at the end of the input. */
+static int reader_getc(struct gs_reader *rd) {
+    if (rd->pos == rd->end && !reader_refill(rd)) return -1;
+    return *rd->pos++;
+}
+
+/*
+ * Copies n bytes to dst: what is left of the chunk first, then straight
+ * from the file without going through the chunk, or chunk by chunk from a
+ * chunk source. Returns the number of bytes copied.
+ */
+static size_t reader_read(struct gs_reader *rd, unsigned char *dst, size_t n) {
+    size_t got = 0;
+
+    for (;;) {
+        size_t k = (size_t)(rd->end - rd->pos);
+        if (k > n - got) k = n - got;
+        if (k) {
+            memcpy(dst + got, rd->pos, k);
+            rd->pos += k;
+            got += k;
+        }
+        if (got == n) break;
+        if (rd->f) {
+            k = fread(dst + got, 1, n - got, rd->f);
+            rd->count.bytes_in += k;
+            rd->count.read_calls++;
+            got += k;
+            break;
+        }
+        if (!reader_refill(rd)) break;
+    }
+    return got;
+}
+
+/*
+ * Reads the next unsigned integer, skipping whitespace and '#' comment
+ * lines, for both the header and the pixel data. Works on the reader's
+ * chunk directly; numbers and comments that straddle a chunk boundary
+ * are continued after a refill. Values above max_allowed are rejected
+ * without overflowing.
+ * Returns 1 on success, 0 for a malformed or out-of-range number and -1
+ * if the input ends before another number starts.
+ */
+static int read_uint(struct gs_reader *rd, int *out, int max_allowed) {
+    const unsigned char *p = rd->pos;
+    const unsigned char *end = rd->end;
+    int cls, val = 0;
+
+    /* Skip whitespace and comments */
+    for (;;) {
+        if (p == end) {
+            if (!reader_refill(rd)) return -1;
+            p = rd->pos;
+            end = rd->end;
+            continue;
+        }
+        cls = char_class[*p];
+        if (cls == CC_SPACE) {
+            p++;
+        } else if (cls == CC_COMMENT) {
+            /* Skip to end of line, possibly across several chunks */
+            const unsigned char *nl;
+            while ((nl = memchr(p, '\n', (size_t)(end - p))) == NULL) {
+                rd->count.comment_bytes += (size_t)(end - p);
+                if (!reader_refill(rd)) return -1;
+                p = rd->pos;
+                end = rd->end;
+            }
+            rd->count.comment_bytes += (size_t)(nl + 1 - p);
+            p = nl + 1;
+        } else {
+            break;
+        }
+    }
+
+    if (cls != CC_DIGIT) {
+        /* First valid character is not a digit - invalid format */
+        rd->pos = p;
+        return 0;
+    }
+
+    /* Parse the integer, refilling if it runs off the end of the chunk */
+    for (;;) {
+        if (val > (max_allowed / 10) + 1) {
+            val = max_allowed + 1; /* Mark as overflow */
+        } else {
+            val = val * 10 + (*p - '0');
+        }
+        if (++p == end) {
+            int more = reader_refill(rd);
+            p = rd->pos;
+            end = rd->end;
+            if (!more) break;
+        }
+        if (char_class[*p] != CC_DIGIT) break;
+    }
+    rd->pos = p;
+
+    if (val > max_allowed) {
+        return 0;
+    }
+
+    *out = val;
+    return 1;
+}
+
+/*
+ * SIMD pixel-data kernels.
+ *
+ * A kernel classifies 64 input bytes at a time into digit and whitespace
+ * bitmasks with vector compares, then walks the numbers with bit scans and
+ * combines their 1-3 digits without any per-byte branching. It only takes
+ * the easy case: plain whitespace-separated numbers of up to three digits
+ * with a value <= 255. At anything else (a comment, a stray byte, a longer
+ * digit run, a number that may continue past the 64-byte window, or the last
+ * 63 bytes of the buffer) it stops in front of the token and lets
+ * read_uint() deal with it, so errors and overflow are reported
+ * exactly as before.
+ */
+typedef size_t (*parse_kernel_fn)(const unsigned char **pp, const unsigned char *end,
+                                  unsigned char *dst, size_t n);
+
+static parse_kernel_fn parse_kernel;  /* NULL: scalar tokenizer only */
+static parse_kernel_fn trusted_kernel;  /* the same for trusted pixel data */
+
+#if defined(HAVE_SIMD_X86) || defined(HAVE_SIMD_NEON)
+typedef void (*mask_fn)(const unsigned char *p, uint64_t *digits, uint64_t *spaces);
+
+/*
+ * Shared block walker; always inlined so each kernel gets its own mask code.
+ * Values above 255 are not tested one by one: the window's values are ORed
+ * together and checked once at its end. A window that fails is given back
+ * whole (count and p as at its start), so read_uint() meets the bad value
+ * and reports it. With trusted set, every non-digit byte separates values,
+ * so comments and stray bytes do not stop the walk, and values are stored
+ * modulo 256 without the window check.
+ */
+static inline __attribute__((always_inline))
+size_t scan_blocks(const unsigned char **pp, const unsigned char *end,
+                   unsigned char *dst, size_t n, mask_fn masks, const int trusted) {
+    const unsigned char *p = *pp;
+    size_t count = 0;
+
+    while (count < n && end - p >= 64) {
+        uint64_t dig, spc;
+        masks(p, &dig, &spc);
+        if (trusted) spc = ~dig;
+
+        uint64_t other = ~(dig | spc);
+        uint64_t starts = dig & ~(dig << 1);  /* p[-1] is never a digit here */
+        size_t first = count;
+        unsigned stop = 64, over = 0;
+
+        if (other) starts &= (other & (0 - other)) - 1;  /* tokens before the first odd byte */
+        while (starts) {
+            unsigned s = (unsigned)__builtin_ctzll(starts);
+            uint64_t rest = ~(dig >> s);
+            unsigned len = rest ? (unsigned)__builtin_ctzll(rest) : 64;
+            const unsigned char *q = p + s;
+            unsigned v;
+
+            if (s + len >= 64 || len > 3) {
+                stop = s;  /* may continue in the next window, or needs the overflow rules */
+                break;
+            }
+            v = q[0] - '0';
+            if (len > 1) v = v * 10 + (q[1] - '0');
+            if (len > 2) v = v * 10 + (q[2] - '0');
+            over |= v;
+            dst[count++] = (unsigned char)v;
+            if (count == n) {
+                stop = s + len;
+                break;
+            }
+            starts &= starts - 1;
+        }
+        if (stop == 64 && other) stop = (unsigned)__builtin_ctzll(other);
+        if (!trusted && over > 255) {
+            count = first;
+            stop = 0;
+        }
+        p += stop;
+        if (stop < 64) break;
+    }
+    *pp = p;
+    return count;
+}
+#endif
+
+#ifdef HAVE_SIMD_X86
+static inline __attribute__((always_inline))
+void masks_sse2(const unsigned char *p, uint64_t *digits, uint64_t *spaces) {
+    const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+    const __m128i tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    const __m128i blank = _mm_set1_epi8(' ');
+    uint64_t d = 0, s = 0;
+
+    for (int i = 0; i < 4; i++) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(const void *)(p + 16 * i));
+        __m128i t = _mm_sub_epi8(b, zero);          /* '0'..'9' -> 0..9 */
+        __m128i u = _mm_sub_epi8(b, tab);           /* '\t'..'\r' -> 0..4 */
+        __m128i isd = _mm_cmpeq_epi8(_mm_min_epu8(t, nine), t);
+        __m128i iss = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(u, four), u),
+                                   _mm_cmpeq_epi8(b, blank));
+        d |= (uint64_t)(uint16_t)_mm_movemask_epi8(isd) << (16 * i);
+        s |= (uint64_t)(uint16_t)_mm_movemask_epi8(iss) << (16 * i);
+    }
+    *digits = d;
+    *spaces = s;
+}
+
+static size_t parse_sse2(const unsigned char **pp, const unsigned char *end,
+                         unsigned char *dst, size_t n) {
+    return scan_blocks(pp, end, dst, n, masks_sse2, 0);
+}
+
+static size_t parse_sse2_trusted(const unsigned char **pp, const unsigned char *end,
+                                 unsigned char *dst, size_t n) {
+    return scan_blocks(pp, end, dst, n, masks_sse2, 1);
+}
+
+__attribute__((target("avx2")))
+static inline void masks_avx2(const unsigned char *p, uint64_t *digits, uint64_t *spaces) {
+    const __m256i zero = _mm256_set1_epi8('0'), nine = _mm256_set1_epi8(9);
+    const __m256i tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+    const __m256i blank = _mm256_set1_epi8(' ');
+    uint64_t d = 0, s = 0;
+
+    for (int i = 0; i < 2; i++) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(const void *)(p + 32 * i));
+        __m256i t = _mm256_sub_epi8(b, zero);
+        __m256i u = _mm256_sub_epi8(b, tab);
+        __m256i isd = _mm256_cmpeq_epi8(_mm256_min_epu8(t, nine), t);
+        __m256i iss = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(u, four), u),
+                                      _mm256_cmpeq_epi8(b, blank));
+        d |= (uint64_t)(uint32_t)_mm256_movemask_epi8(isd) << (32 * i);
+        s |= (uint64_t)(uint32_t)_mm256_movemask_epi8(iss) << (32 * i);
+    }
+    *digits = d;
+    *spaces = s;
+}
+
+__attribute__((target("avx2")))
+static size_t parse_avx2(const unsigned char **pp, const unsigned char *end,
+                         unsigned char *dst, size_t n) {
+    return scan_blocks(pp, end, dst, n, masks_avx2, 0);
+}
+
+__attribute__((target("avx2")))
+static size_t parse_avx2_trusted(const unsigned char **pp, const unsigned char *end,
+                                 unsigned char *dst, size_t n) {
+    return scan_blocks(pp, end, dst, n, masks_avx2, 1);
+}
+#endif
+
+#ifdef HAVE_SIMD_NEON
+/* movemask replacement: one bit per byte of four compare results. */
+static inline uint64_t neon_movemask64(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3) {
+    const uint8x16_t bit = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t s0 = vpaddq_u8(vandq_u8(m0, bit), vandq_u8(m1, bit));
+    uint8x16_t s1 = vpaddq_u8(vandq_u8(m2, bit), vandq_u8(m3, bit));
+    s0 = vpaddq_u8(s0, s1);
+    s0 = vpaddq_u8(s0, s0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+
+static inline __attribute__((always_inline))
+void masks_neon(const unsigned char *p, uint64_t *digits, uint64_t *spaces) {
+    uint8x16_t d[4], s[4];
+
+    for (int i = 0; i < 4; i++) {
+        uint8x16_t b = vld1q_u8(p + 16 * i);
+        d[i] = vcleq_u8(vsubq_u8(b, vdupq_n_u8('0')), vdupq_n_u8(9));
+        s[i] = vorrq_u8(vcleq_u8(vsubq_u8(b, vdupq_n_u8('\t')), vdupq_n_u8(4)),
+                        vceqq_u8(b, vdupq_n_u8(' ')));
+    }
+    *digits = neon_movemask64(d[0], d[1], d[2], d[3]);
+    *spaces = neon_movemask64(s[0], s[1], s[2], s[3]);
+}
+
+static size_t parse_neon(const unsigned char **pp, const unsigned char *end,
+                         unsigned char *dst, size_t n) {
+    return scan_blocks(pp, end, dst, n, masks_neon, 0);
+}
+
+static size_t parse_neon_trusted(const unsigned char **pp, const unsigned char *end,
+                                 unsigned char *dst, size_t n) {
+    return scan_blocks(pp, end, dst, n, masks_neon, 1);
+}
+#endif
+
+/* Picks the best kernel for this CPU; called from gs_init(). */
+static void select_parse_kernel(int allow_simd) {
+    parse_kernel = NULL;
+    trusted_kernel = NULL;
+    if (!allow_simd) return;
+#if defined(HAVE_SIMD_X86)
+    int avx2 = __builtin_cpu_supports("avx2");
+    parse_kernel = avx2 ? parse_avx2 : parse_sse2;
+    trusted_kernel = avx2 ? parse_avx2_trusted : parse_sse2_trusted;
+#elif defined(HAVE_SIMD_NEON)
+    parse_kernel = parse_neon;
+    trusted_kernel = parse_neon_trusted;
+#endif
+}
+
+/*
+ * read_uint() for trusted pixel data: any non-digit byte separates values,
+ * so '#' starts no comment, and the value is not range-checked (it wraps,
+ * it never overflows). Returns 1, or -1 if the input ends first.
+ */
+static int read_uint_trusted(struct gs_reader *rd, unsigned *out) {
+    const unsigned char *p = rd->pos, *end = rd->end;
+    unsigned val = 0;
+
+    for (;;) {
+        if (p == end) {
+            if (!reader_refill(rd)) return -1;
+            p = rd->pos;
+            end = rd->end;
+        } else if (char_class[*p] != CC_DIGIT) {
+            p++;
+        } else {
+            break;
+        }
+    }
+    for (;;) {
+        val = val * 10 + (unsigned)(*p - '0');
+        if (++p == end) {
+            int more = reader_refill(rd);
+            p = rd->pos;
+            end = rd->end;
+            if (!more) break;
+        }
+        if (char_class[*p] != CC_DIGIT) break;
+    }
+    rd->pos = p;
+    *out = val;
+    return 1;
+}
+
+/* read_pixel_values() with the trusted tokenizers; only the end of the input stops them. */
+static size_t read_trusted_values(struct gs_reader *rd, unsigned char *dst, size_t n,
+                                  int *status) {
+    size_t count = 0;
+    unsigned v;
+
+    *status = 1;
+    while (count < n) {
+        if (trusted_kernel) {
+            count += trusted_kernel(&rd->pos, rd->end, dst + count, n - count);
+            if (count == n) break;
+        }
+        if (read_uint_trusted(rd, &v) != 1) {
+            *status = -1;
+            break;
+        }
+        dst[count++] = (unsigned char)v;
+    }
+    return count;
+}
+
+/*
+ * Reads n pixel-data values into dst, using the SIMD kernel where it
+ * applies and read_uint() everywhere else. Returns the number of
+ * values stored; if that is short of n, *status holds the failing
+ * read_uint() result (0 malformed/out of range, -1 end of input).
+ * With trusted set the trusted tokenizers are used instead.
+ */
+static size_t read_pixel_values(struct gs_reader *rd, unsigned char *dst, size_t n,
+                                int trusted, int *status) {
+    size_t count = 0;
+    int v;
+
+    if (trusted) return read_trusted_values(rd, dst, n, status);
+    *status = 1;
+    while (count < n) {
+        if (parse_kernel) {
+            count += parse_kernel(&rd->pos, rd->end, dst + count, n - count);
+            if (count == n) break;
+        }
+        int rc = read_uint(rd, &v, 255);
+        if (rc != 1) {
+            *status = rc;
+            break;
+        }
+        dst[count++] = (unsigned char)v;
+    }
+    return count;
+}
+
+/*
+ * Skips n pixel-data values without converting them: a value is any run
+ * of bytes up to the next whitespace or comment, so nothing is validated.
+ * Returns the number skipped; short of n only at the end of the input.
+ */
+static size_t skip_values(struct gs_reader *rd, size_t n) {
+    const unsigned char *p = rd->pos, *end = rd->end;
+    size_t count = 0;
+    int in_value = 0;
+
+    while (count < n || in_value) {
+        if (p == end) {
+            rd->pos = p;
+            if (!reader_refill(rd)) return count;
+            p = rd->pos;
+            end = rd->end;
+            continue;
+        }
+        int cls = char_class[*p];
+        if (cls == CC_COMMENT) {
+            const unsigned char *nl;
+            while ((nl = memchr(p, '\n', (size_t)(end - p))) == NULL) {
+                rd->count.comment_bytes += (size_t)(end - p);
+                if (!reader_refill(rd)) return count;
+                p = rd->pos;
+                end = rd->end;
+            }
+            rd->count.comment_bytes += (size_t)(nl + 1 - p);
+            p = nl + 1;
+            in_value = 0;
+        } else if (cls == CC_SPACE) {
+            p++;
+            in_value = 0;
+        } else {
+            count += !in_value;
+            in_value = 1;
+            p++;
+        }
+    }
+    rd->pos = p;
+    return count;
+}
+
+/* Skips n raster bytes. Returns the number skipped. */
+static size_t reader_skip(struct gs_reader *rd, size_t n) {
+    size_t done = 0;
+
+    for (;;) {
+        size_t k = (size_t)(rd->end - rd->pos);
+        if (k > n - done) k = n - done;
+        rd->pos += k;
+        done += k;
+        if (done == n || !reader_refill(rd)) break;
+    }
+    return done;
+}
+
+/*
+ * Fixed-width text LUTs. Every entry is padded so that it can be stored
+ * with one full-width copy whatever its length; the writer then advances
+ * by the real length and the next store overwrites the padding
+ * (GS_ROW_SLACK covers the overrun past the last pixel).
+ *
+ * The tables are constant initializers, spelled out by the macros below
+ * for every v, so they live in .rodata and need no start-up pass.
+ */
+#define TEXT_LEN(v) ((v) >= 100 ? 3 : (v) >= 10 ? 2 : 1)
+#define TEXT_DIGIT(v, i) \
+    ('0' + (v) / (TEXT_LEN(v) - (i) == 3 ? 100 : TEXT_LEN(v) - (i) == 2 ? 10 : 1) % 10)
+#define NUM_CHAR(v, p) ((p) < TEXT_LEN(v) ? TEXT_DIGIT(v, p) : ' ')
+#define PIX_CHAR(v, p) \
+    ((p) / (TEXT_LEN(v) + 1) < 3 && (p) % (TEXT_LEN(v) + 1) < TEXT_LEN(v) \
+     ? TEXT_DIGIT(v, (p) % (TEXT_LEN(v) + 1)) : ' ')
+
+#define NUM_ENTRY(v) { NUM_CHAR(v, 0), NUM_CHAR(v, 1), NUM_CHAR(v, 2), NUM_CHAR(v, 3) }
+#define PIX_ENTRY(v) { PIX_CHAR(v, 0), PIX_CHAR(v, 1), PIX_CHAR(v, 2), PIX_CHAR(v, 3), \
+                       PIX_CHAR(v, 4), PIX_CHAR(v, 5), PIX_CHAR(v, 6), PIX_CHAR(v, 7), \
+                       PIX_CHAR(v, 8), PIX_CHAR(v, 9), PIX_CHAR(v, 10), PIX_CHAR(v, 11), \
+                       PIX_CHAR(v, 12), PIX_CHAR(v, 13), PIX_CHAR(v, 14), PIX_CHAR(v, 15) }
+#define NUM_LEN(v) TEXT_LEN(v)
+#define PIX_LEN(v) (3 * (TEXT_LEN(v) + 1))
+#define PAIR_ENTRY(v) { '0' + (v) / 10, '0' + (v) % 10 }
+
+#define REP4(m, v) m(v), m((v) + 1), m((v) + 2), m((v) + 3)
+#define REP16(m, v) REP4(m, v), REP4(m, (v) + 4), REP4(m, (v) + 8), REP4(m, (v) + 12)
+#define REP64(m, v) REP16(m, v), REP16(m, (v) + 16), REP16(m, (v) + 32), REP16(m, (v) + 48)
+#define REP256(m) REP64(m, 0), REP64(m, 64), REP64(m, 128), REP64(m, 192)
+#define REP100(m) REP64(m, 0), REP16(m, 64), REP16(m, 80), REP4(m, 96)
+
+static const char num_text[256][4] = { REP256(NUM_ENTRY) };     /* "0".."255" + ' ' padding */
+static const uint8_t num_len[256] = { REP256(NUM_LEN) };        /* digit count */
+static const char pix_text[256][16] = { REP256(PIX_ENTRY) };    /* "v v v " + ' ' padding */
+static const uint8_t pix_len[256] = { REP256(PIX_LEN) };        /* triplet incl. trailing ' ' */
+static const char pair_text[100][2] = { REP100(PAIR_ENTRY) };   /* "00".."99", 16-bit samples */
+
+static void select_planar_kernels(int allow_simd);  /* with the conversion kernels */
+
+void gs_init(int flags) {
+    select_parse_kernel(!(flags & GS_INIT_NO_SIMD));
+    select_planar_kernels(!(flags & GS_INIT_NO_SIMD));
+}
+
+void gs_decoder_init_file(struct gs_decoder *d, FILE *f, unsigned char *chunk) {
+    memset(d, 0, sizeof *d);
+    reader_init(&d->rd, f, chunk);
+}
+
+void gs_decoder_init_mem(struct gs_decoder *d, const void *data, size_t len) {
+    memset(d, 0, sizeof *d);
+    reader_init_span(&d->rd, data, len);
+}
+
+void gs_decoder_init_source(struct gs_decoder *d, gs_next_chunk_fn next, void *ctx) {
+    memset(d, 0, sizeof *d);
+    d->rd.next = next;
+    d->rd.ctx = ctx;
+}
+
+/*
+ * Parses and validates the header: optional leading whitespace and comment
+ * lines, the magic number, then width, height and maximum value with
+ * comments allowed anywhere in between. A P6 header ends in exactly one
+ * whitespace byte.
+ */
+int gs_read_header(struct gs_decoder *d) {
+    struct gs_reader *rd = &d->rd;
+    int c;
+
+    do {
+        c = reader_getc(rd);
+        if (c < 0) return GS_ERR_HEADER_EOF;
+        while (c == '#') {
+            /* Skip to end of line, then take the first char after it */
+            do {
+                rd->count.comment_bytes++;  /* the '#' and the rest of the line */
+                c = reader_getc(rd);
+            } while (c >= 0 && c != '\n');
+            rd->count.comment_bytes += c >= 0;
+            if (c >= 0) c = reader_getc(rd);
+        }
+    } while (c >= 0 && char_class[c] == CC_SPACE);
+
+    if (c != 'P') return GS_ERR_MAGIC;
+    c = reader_getc(rd);
+    if (c != '3' && c != '6') return GS_ERR_MAGIC;
+    d->format = c == '6' ? GS_FMT_P6 : GS_FMT_P3;
+
+    if (read_uint(rd, &d->width, GS_MAX_DIMENSION) != 1 ||
+        read_uint(rd, &d->height, GS_MAX_DIMENSION) != 1) {
+        return GS_ERR_DIMENSIONS;
+    }
+    if (d->width <= 0 || d->height <= 0) return GS_ERR_BAD_DIMENSIONS;
+    /* Every byte of the raster must be addressable (only a limit on 32-bit hosts) */
+    if ((uint64_t)d->width * (uint64_t)d->height > SIZE_MAX / 6) return GS_ERR_TOO_LARGE;
+    if (read_uint(rd, &d->maxval, GS_MAX_MAXVAL) != 1) return GS_ERR_MAXVAL;
+    if (d->maxval < 1) return GS_ERR_BAD_MAXVAL;
+
+    if (d->format == GS_FMT_P6) {
+        c = reader_getc(rd);
+        if (c < 0 || char_class[c] != CC_SPACE) return GS_ERR_SEPARATOR;
+    }
+    d->row = 0;
+    d->col = 0;
+    return GS_OK;
+}
+
+/*
+ * P3 values are range-checked by the tokenizer; a P6 row is the raster
+ * bytes themselves. On a short or malformed row err_row/err_col name the
+ * first pixel that could not be read.
+ */
+int gs_read_row(struct gs_decoder *d, unsigned char *rgb, const unsigned char **row) {
+    return gs_read_pixels(d, rgb, d->width - d->col, row);
+}
+
+/* Moves past n pixels of the current row. */
+static void advance_pixels(struct gs_decoder *d, int n) {
+    d->col += n;
+    if (d->col == d->width) {
+        d->col = 0;
+        d->row++;
+    }
+}
+
+int gs_read_pixels(struct gs_decoder *d, unsigned char *rgb, int n, const unsigned char **row) {
+    struct gs_reader *rd = &d->rd;
+    size_t want = (size_t)n * 3;
+    size_t got;
+
+    if (d->maxval != 255 || n < 1 || n > d->width - d->col) return GS_ERR_ARG;
+    if (d->row_offsets && d->col == 0) d->row_offsets[d->row] = gs_decoder_offset(d);
+    if (d->format == GS_FMT_P3) {
+        int status;
+        got = read_pixel_values(rd, rgb, want, d->trusted, &status);
+    } else if (rd->f == NULL && rd->next == NULL && row) {
+        /* In memory: hand out the raster in place */
+        got = (size_t)(rd->end - rd->pos);
+        if (got >= want) {
+            *row = rd->pos;
+            rd->pos += want;
+            rd->count.values += want;
+            advance_pixels(d, n);
+            return GS_OK;
+        }
+    } else {
+        got = reader_read(rd, rgb, want);
+    }
+    rd->count.values += got;
+    if (got != want) {
+        d->err_row = d->row;
+        d->err_col = d->col + (int)(got / 3);
+        return GS_ERR_PIXEL;
+    }
+    if (row) *row = rgb;
+    advance_pixels(d, n);
+    return GS_OK;
+}
+
+uint64_t gs_decoder_offset(const struct gs_decoder *d) {
+    return d->rd.count.bytes_in - (uint64_t)(d->rd.end - d->rd.pos);
+}
+
+void gs_decoder_resume(struct gs_decoder *d, int format, int width, int height, int maxval,
+                       int row) {
+    d->format = format;
+    d->width = width;
+    d->height = height;
+    d->maxval = maxval;
+    d->row = row;
+    d->col = 0;
+}
+
+void gs_decoder_counters(const struct gs_decoder *d, struct gs_counters *out) {
+    *out = d->rd.count;
+}
+
+/*
+ * The wide path is scalar: P3 values go through read_uint() with maxval
+ * as the limit, and binary samples are read into rgb as bytes and widened
+ * in place (big-endian pairs front to back, single bytes back to front,
+ * so no byte is overwritten before it is read).
+ */
+int gs_read_row16(struct gs_decoder *d, uint16_t *rgb) {
+    return gs_read_pixels16(d, rgb, d->width - d->col);
+}
+
+int gs_read_pixels16(struct gs_decoder *d, uint16_t *rgb, int n) {
+    struct gs_reader *rd = &d->rd;
+    size_t want = (size_t)n * 3;
+    size_t got = 0;
+
+    if (n < 1 || n > d->width - d->col) return GS_ERR_ARG;
+    if (d->row_offsets && d->col == 0) d->row_offsets[d->row] = gs_decoder_offset(d);
+    if (d->format == GS_FMT_P3 && d->trusted) {
+        unsigned v;
+        while (got < want && read_uint_trusted(rd, &v) == 1) rgb[got++] = (uint16_t)v;
+    } else if (d->format == GS_FMT_P3) {
+        int v;
+        while (got < want && read_uint(rd, &v, d->maxval) == 1) rgb[got++] = (uint16_t)v;
+    } else {
+        unsigned char *bytes = (unsigned char *)rgb;
+        unsigned over = 0;
+        if (d->maxval > 255) {
+            got = reader_read(rd, bytes, want * 2) / 2;
+            for (size_t i = 0; i < got; i++) {
+                rgb[i] = (uint16_t)(bytes[2 * i] << 8 | bytes[2 * i + 1]);
+            }
+        } else {
+            got = reader_read(rd, bytes, want);
+            for (size_t i = got; i-- > 0;) rgb[i] = bytes[i];
+        }
+        /* One branch-free pass; the bad sample is only looked for if there is one */
+        if (!d->trusted) {
+            for (size_t i = 0; i < got; i++) over |= rgb[i] > d->maxval;
+        }
+        if (over) {
+            size_t i = 0;
+            while (rgb[i] <= d->maxval) i++;
+            got = i;
+        }
+    }
+    rd->count.values += got;
+    if (got != want) {
+        d->err_row = d->row;
+        d->err_col = d->col + (int)(got / 3);
+        return GS_ERR_PIXEL;
+    }
+    advance_pixels(d, n);
+    return GS_OK;
+}
+
+int gs_skip_rows(struct gs_decoder *d, int n) {
+    size_t want = (size_t)d->width * 3;
+
+    if (n < 0 || d->maxval != 255 || d->col != 0) return GS_ERR_ARG;
+    for (int y = 0; y < n; y++) {
+        if (d->row_offsets) d->row_offsets[d->row] = gs_decoder_offset(d);
+        size_t got = d->format == GS_FMT_P3 ? skip_values(&d->rd, want)
+                                            : reader_skip(&d->rd, want);
+        if (got != want) {
+            d->err_row = d->row;
+            d->err_col = (int)(got / 3);
+            return GS_ERR_PIXEL;
+        }
+        d->row++;
+    }
+    return GS_OK;
+}
+
+/*
+ * Three stages: skip the values left of the window, decode the window,
+ * skip the rest of the row. A stage only runs if the one before it
+ * completed, so got always counts from the start of the row.
+ */
+int gs_read_row_part(struct gs_decoder *d, int x, int w, unsigned char *rgb,
+                     const unsigned char **row) {
+    struct gs_reader *rd = &d->rd;
+    size_t before = (size_t)x * 3, want = (size_t)w * 3;
+    size_t total = (size_t)d->width * 3;
+    size_t got, decoded = 0;
+
+    if (x < 0 || w < 1 || x > d->width - w || d->maxval != 255 || d->col != 0) {
+        return GS_ERR_ARG;
+    }
+    if (d->row_offsets) d->row_offsets[d->row] = gs_decoder_offset(d);
+    if (d->format == GS_FMT_P3) {
+        int status;
+        got = skip_values(rd, before);
+        if (got == before) {
+            got += decoded = read_pixel_values(rd, rgb, want, d->trusted, &status);
+        }
+        if (got == before + want) got += skip_values(rd, total - got);
+    } else if (rd->f == NULL && rd->next == NULL && row) {
+        got = (size_t)(rd->end - rd->pos);
+        if (got >= total) {
+            *row = rd->pos + before;
+            rd->pos += total;
+            rd->count.values += want;
+            d->row++;
+            return GS_OK;
+        }
+    } else {
+        got = reader_skip(rd, before);
+        if (got == before) got += decoded = reader_read(rd, rgb, want);
+        if (got == before + want) got += reader_skip(rd, total - got);
+    }
+    rd->count.values += decoded;
+    if (got != total) {
+        d->err_row = d->row;
+        d->err_col = (int)(got / 3);
+        return GS_ERR_PIXEL;
+    }
+    if (row) *row = rgb;
+    d->row++;
+    return GS_OK;
+}
+
+const unsigned char *gs_decoder_pending(const struct gs_decoder *d, size_t *len) {
+    *len = (size_t)(d->rd.end - d->rd.pos);
+    return d->rd.pos;
+}
+
+size_t gs_parse_values(const unsigned char *data, size_t len, unsigned char *dst,
+                       size_t n, int trusted, int *status) {
+    struct gs_reader rd;
+
+    reader_init_span(&rd, data, len);
+    return read_pixel_values(&rd, dst, n, trusted, status);
+}
+
+/*
+ * Gray conversion kernels. One is chosen per converter by
+ * gs_converter_init() and applied to whole rows, so the per-pixel loop
+ * never branches on the weighting mode. None of them divides or touches
+ * floating point: the weighted modes are three table lookups and an add
+ * in 16.16 fixed point.
+ */
+
+/*
+ * Exact (r + g + b) / 3 for every sum up to 765: 21846 / 65536 is close
+ * enough to 1/3 that the floor never moves, and the 16-bit high multiply
+ * vectorizes well.
+ */
+static void gray_average(const struct gs_converter *c, const unsigned char *rgb,
+                         unsigned char *gray, int width) {
+    (void)c;
+    for (int x = 0; x < width; x++) {
+        unsigned sum = rgb[3 * x] + rgb[3 * x + 1] + rgb[3 * x + 2];
+        gray[x] = (unsigned char)((sum * 21846u) >> 16);
+    }
+}
+
+/* Rounded weighted sum; weights summing to 65536 keep the result <= 255. */
+static void gray_lut(const struct gs_converter *c, const unsigned char *rgb,
+                     unsigned char *gray, int width) {
+    const uint32_t *lut_r = c->lut_r, *lut_g = c->lut_g, *lut_b = c->lut_b;
+    for (int x = 0; x < width; x++) {
+        uint32_t acc = lut_r[rgb[3 * x]] + lut_g[rgb[3 * x + 1]] + lut_b[rgb[3 * x + 2]];
+        gray[x] = (unsigned char)(acc >> 16);
+    }
+}
+
+/* Weighted sum of decoded channels, mapped through the tone curve. */
+static void gray_lut_curve(const struct gs_converter *c, const unsigned char *rgb,
+                           unsigned char *gray, int width) {
+    const uint32_t *lut_r = c->lut_r, *lut_g = c->lut_g, *lut_b = c->lut_b;
+    for (int x = 0; x < width; x++) {
+        uint32_t acc = lut_r[rgb[3 * x]] + lut_g[rgb[3 * x + 1]] + lut_b[rgb[3 * x + 2]];
+        gray[x] = c->tone_curve[acc];
+    }
+}
+
+/* 16-bit kernels: the same arithmetic as above without the tables. */
+static void gray16_average(const struct gs_converter *c, const uint16_t *rgb, uint16_t *gray,
+                           int width) {
+    (void)c;
+    for (int x = 0; x < width; x++) {
+        uint32_t sum = (uint32_t)rgb[3 * x] + rgb[3 * x + 1] + rgb[3 * x + 2];
+        gray[x] = (uint16_t)(sum / 3);
+    }
+}
+
+/* At most 65535 * 65536 + 32768 before the shift, so 32 bits suffice. */
+static void gray16_weighted(const struct gs_converter *c, const uint16_t *rgb, uint16_t *gray,
+                            int width) {
+    uint32_t wr = c->wr, wg = c->wg, wb = c->wb;
+    for (int x = 0; x < width; x++) {
+        uint32_t acc = wr * rgb[3 * x] + wg * rgb[3 * x + 1] + wb * rgb[3 * x + 2] + 32768u;
+        gray[x] = (uint16_t)(acc >> 16);
+    }
+}
+
+/*
+ * Planar kernels. gs_convert_row() hands rows of the weighted and average
+ * modes to them a GS_STRIP_PIXELS strip at a time: the strip is split into
+ * R, G and B planes, which with the gray strip stay in L1, and then
+ * converted a vector at a time. The interleaved kernels above remain for
+ * the tone curve, whose lookups do not vectorize, and for builds without
+ * SIMD. All kernels give the same result for the same converter.
+ */
+typedef void (*split_fn)(const unsigned char *rgb, int width, unsigned char *r,
+                         unsigned char *g, unsigned char *b);
+typedef void (*planar_fn)(const struct gs_converter *c, const unsigned char *r,
+                          const unsigned char *g, const unsigned char *b, unsigned char *gray,
+                          int width);
+
+static void split_scalar(const unsigned char *rgb, int width, unsigned char *r,
+                         unsigned char *g, unsigned char *b) {
+    for (int x = 0; x < width; x++) {
+        r[x] = rgb[3 * x];
+        g[x] = rgb[3 * x + 1];
+        b[x] = rgb[3 * x + 2];
+    }
+}
+
+static void planes_average(const struct gs_converter *c, const unsigned char *r,
+                           const unsigned char *g, const unsigned char *b, unsigned char *gray,
+                           int width) {
+    (void)c;
+    for (int x = 0; x < width; x++) {
+        unsigned sum = r[x] + g[x] + b[x];
+        gray[x] = (unsigned char)((sum * 21846u) >> 16);
+    }
+}
+
+static void planes_weighted(const struct gs_converter *c, const unsigned char *r,
+                            const unsigned char *g, const unsigned char *b, unsigned char *gray,
+                            int width) {
+    uint32_t wr = c->wr, wg = c->wg, wb = c->wb;
+    for (int x = 0; x < width; x++) {
+        gray[x] = (unsigned char)((wr * r[x] + wg * g[x] + wb * b[x] + 32768u) >> 16);
+    }
+}
+
+static void planes_curve(const struct gs_converter *c, const unsigned char *r,
+                         const unsigned char *g, const unsigned char *b, unsigned char *gray,
+                         int width) {
+    for (int x = 0; x < width; x++) {
+        gray[x] = c->tone_curve[c->lut_r[r[x]] + c->lut_g[g[x]] + c->lut_b[b[x]]];
+    }
+}
+
+#ifdef HAVE_SIMD_X86
+/* Deinterleaves 16 pixels per step with four rounds of SSE2 byte unpacks. */
+static void split_sse2(const unsigned char *rgb, int width, unsigned char *r, unsigned char *g,
+                       unsigned char *b) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i *p = (const __m128i *)(const void *)(rgb + 3 * x);
+        __m128i a0 = _mm_loadu_si128(p), a1 = _mm_loadu_si128(p + 1);
+        __m128i a2 = _mm_loadu_si128(p + 2);
+        for (int round = 0; round < 4; round++) {
+            __m128i t0 = _mm_unpacklo_epi8(a0, _mm_unpackhi_epi64(a1, a1));
+            __m128i t1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(a0, a0), a2);
+            __m128i t2 = _mm_unpacklo_epi8(a1, _mm_unpackhi_epi64(a2, a2));
+            a0 = t0;
+            a1 = t1;
+            a2 = t2;
+        }
+        _mm_storeu_si128((__m128i *)(void *)(r + x), a0);
+        _mm_storeu_si128((__m128i *)(void *)(g + x), a1);
+        _mm_storeu_si128((__m128i *)(void *)(b + x), a2);
+    }
+    split_scalar(rgb + 3 * x, width - x, r + x, g + x, b + x);
+}
+
+static void planes_average_sse2(const struct gs_converter *c, const unsigned char *r,
+                                const unsigned char *g, const unsigned char *b,
+                                unsigned char *gray, int width) {
+    const __m128i zero = _mm_setzero_si128(), third = _mm_set1_epi16(21846);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i vr = _mm_loadu_si128((const __m128i *)(const void *)(r + x));
+        __m128i vg = _mm_loadu_si128((const __m128i *)(const void *)(g + x));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(const void *)(b + x));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(vr, zero),
+                                                 _mm_unpacklo_epi8(vg, zero)),
+                                   _mm_unpacklo_epi8(vb, zero));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(vr, zero),
+                                                 _mm_unpackhi_epi8(vg, zero)),
+                                   _mm_unpackhi_epi8(vb, zero));
+        lo = _mm_mulhi_epu16(lo, third);
+        hi = _mm_mulhi_epu16(hi, third);
+        _mm_storeu_si128((__m128i *)(void *)(gray + x), _mm_packus_epi16(lo, hi));
+    }
+    planes_average(c, r + x, g + x, b + x, gray + x, width - x);
+}
+
+/*
+ * 16 weighted sums with pmaddwd, which takes signed 16-bit weights. As the
+ * weights sum to 65536, w * v = (w - 32768) * v + 16384 * 2v, and the
+ * 16384 terms of the three channels add up to 16384 * 2(r + g + b). So
+ * (r, g) pairs go with (wr, wg) - 32768 and (b, 2(r + g + b)) pairs with
+ * (wb - 32768, 16384); the sums are exact in 32 bits.
+ */
+static void planes_weighted_sse2(const struct gs_converter *c, const unsigned char *r,
+                                 const unsigned char *g, const unsigned char *b,
+                                 unsigned char *gray, int width) {
+    const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi32(32768);
+    const __m128i wrg = _mm_set1_epi32((int)((c->wg - 32768) << 16 | ((c->wr - 32768) & 0xffff)));
+    const __m128i wbs = _mm_set1_epi32((int)(16384u << 16 | ((c->wb - 32768) & 0xffff)));
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i vr = _mm_loadu_si128((const __m128i *)(const void *)(r + x));
+        __m128i vg = _mm_loadu_si128((const __m128i *)(const void *)(g + x));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(const void *)(b + x));
+        __m128i out[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i r16 = h ? _mm_unpackhi_epi8(vr, zero) : _mm_unpacklo_epi8(vr, zero);
+            __m128i g16 = h ? _mm_unpackhi_epi8(vg, zero) : _mm_unpacklo_epi8(vg, zero);
+            __m128i b16 = h ? _mm_unpackhi_epi8(vb, zero) : _mm_unpacklo_epi8(vb, zero);
+            __m128i s2 = _mm_slli_epi16(_mm_add_epi16(_mm_add_epi16(r16, g16), b16), 1);
+            __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r16, g16), wrg),
+                                       _mm_madd_epi16(_mm_unpacklo_epi16(b16, s2), wbs));
+            __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r16, g16), wrg),
+                                       _mm_madd_epi16(_mm_unpackhi_epi16(b16, s2), wbs));
+            lo = _mm_srli_epi32(_mm_add_epi32(lo, half), 16);
+            hi = _mm_srli_epi32(_mm_add_epi32(hi, half), 16);
+            out[h] = _mm_packs_epi32(lo, hi);
+        }
+        _mm_storeu_si128((__m128i *)(void *)(gray + x), _mm_packus_epi16(out[0], out[1]));
+    }
+    planes_weighted(c, r + x, g + x, b + x, gray + x, width - x);
+}
+#endif
+
+#ifdef HAVE_SIMD_NEON
+static void split_neon(const unsigned char *rgb, int width, unsigned char *r, unsigned char *g,
+                       unsigned char *b) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x3_t v = vld3q_u8(rgb + 3 * x);
+        vst1q_u8(r + x, v.val[0]);
+        vst1q_u8(g + x, v.val[1]);
+        vst1q_u8(b + x, v.val[2]);
+    }
+    split_scalar(rgb + 3 * x, width - x, r + x, g + x, b + x);
+}
+
+static void planes_average_neon(const struct gs_converter *c, const unsigned char *r,
+                                const unsigned char *g, const unsigned char *b,
+                                unsigned char *gray, int width) {
+    const uint16x4_t third = vdup_n_u16(21846);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint16x8_t sum = vaddw_u8(vaddl_u8(vld1_u8(r + x), vld1_u8(g + x)), vld1_u8(b + x));
+        uint16x4_t lo = vshrn_n_u32(vmull_u16(vget_low_u16(sum), third), 16);
+        uint16x4_t hi = vshrn_n_u32(vmull_u16(vget_high_u16(sum), third), 16);
+        vst1_u8(gray + x, vmovn_u16(vcombine_u16(lo, hi)));
+    }
+    planes_average(c, r + x, g + x, b + x, gray + x, width - x);
+}
+
+/* Needs every weight below 65536, so that it fits a 16-bit lane. */
+static void planes_weighted_neon(const struct gs_converter *c, const unsigned char *r,
+                                 const unsigned char *g, const unsigned char *b,
+                                 unsigned char *gray, int width) {
+    const uint16x4_t wr = vdup_n_u16((uint16_t)c->wr), wg = vdup_n_u16((uint16_t)c->wg);
+    const uint16x4_t wb = vdup_n_u16((uint16_t)c->wb);
+    const uint32x4_t half = vdupq_n_u32(32768);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint16x8_t vr = vmovl_u8(vld1_u8(r + x)), vg = vmovl_u8(vld1_u8(g + x));
+        uint16x8_t vb = vmovl_u8(vld1_u8(b + x));
+        uint32x4_t lo = vmlal_u16(vmlal_u16(vmlal_u16(half, vget_low_u16(vr), wr),
+                                            vget_low_u16(vg), wg), vget_low_u16(vb), wb);
+        uint32x4_t hi = vmlal_u16(vmlal_u16(vmlal_u16(half, vget_high_u16(vr), wr),
+                                            vget_high_u16(vg), wg), vget_high_u16(vb), wb);
+        vst1_u8(gray + x, vmovn_u16(vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16))));
+    }
+    planes_weighted(c, r + x, g + x, b + x, gray + x, width - x);
+}
+#endif
+
+/* Vectorized split and planar kernels, or NULL; set by gs_init(). */
+static split_fn split_kernel;
+static planar_fn planar_average_kernel, planar_weighted_kernel;
+
+static void select_planar_kernels(int allow_simd) {
+    split_kernel = NULL;
+    planar_average_kernel = planar_weighted_kernel = NULL;
+    if (!allow_simd) return;
+#if defined(HAVE_SIMD_X86)
+    split_kernel = split_sse2;
+    planar_average_kernel = planes_average_sse2;
+    planar_weighted_kernel = planes_weighted_sse2;
+#elif defined(HAVE_SIMD_NEON)
+    split_kernel = split_neon;
+    planar_average_kernel = planes_average_neon;
+    planar_weighted_kernel = planes_weighted_neon;
+#endif
+}
+
+/* sRGB transfer functions on 0..1 values. */
+static double srgb_to_linear(double c) {
+    return c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+}
+
+static double linear_to_srgb(double y) {
+    return y <= 0.0031308 ? y * 12.92 : 1.055 * pow(y, 1.0 / 2.4) - 0.055;
+}
+
+/*
+ * Converts real-valued weights into 16.16 fixed point summing to exactly
+ * 65536; the rounding remainder goes to the largest weight. Returns 0 if
+ * the weights are negative or all zero.
+ */
+static int set_gray_weights(struct gs_converter *c, double r, double g, double b) {
+    double sum = r + g + b;
+    if (r < 0 || g < 0 || b < 0 || !(sum > 0)) return 0;
+
+    uint32_t wr = (uint32_t)(r / sum * 65536.0 + 0.5);
+    uint32_t wg = (uint32_t)(g / sum * 65536.0 + 0.5);
+    uint32_t wb = (uint32_t)(b / sum * 65536.0 + 0.5);
+    int32_t fix = 65536 - (int32_t)(wr + wg + wb);
+    if (wr >= wg && wr >= wb) wr = (uint32_t)((int32_t)wr + fix);
+    else if (wg >= wb) wg = (uint32_t)((int32_t)wg + fix);
+    else wb = (uint32_t)((int32_t)wb + fix);
+
+    c->wr = wr;
+    c->wg = wg;
+    c->wb = wb;
+    return 1;
+}
+
+/*
+ * Picks the conversion kernel and builds its tables. Either linear light
+ * or a gamma routes even the average mode through the curve kernel, with
+ * equal weights.
+ */
+int gs_converter_init(struct gs_converter *c, int mode, const double weights[3],
+                      int linear, double gamma) {
+    int curve = linear || gamma != 1.0;
+    int ok;
+
+    switch (mode) {
+    case GS_MODE_BT601: ok = set_gray_weights(c, 0.299, 0.587, 0.114); break;
+    case GS_MODE_BT709: ok = set_gray_weights(c, 0.2126, 0.7152, 0.0722); break;
+    case GS_MODE_CUSTOM: ok = set_gray_weights(c, weights[0], weights[1], weights[2]); break;
+    default: ok = set_gray_weights(c, 1, 1, 1); break;
+    }
+    if (!ok || !(gamma > 0)) return GS_ERR_ARG;
+
+    c->kernel16 = curve ? NULL : mode == GS_MODE_AVERAGE ? gray16_average : gray16_weighted;
+    c->strips = 0;
+    /* Tables left from an earlier set-up would otherwise stay in c */
+    if (!curve) memset(c->tone_curve, 0, sizeof c->tone_curve);
+    if (mode == GS_MODE_AVERAGE && !curve) {
+        memset(c->lut_r, 0, sizeof c->lut_r);
+        memset(c->lut_g, 0, sizeof c->lut_g);
+        memset(c->lut_b, 0, sizeof c->lut_b);
+        c->kernel = gray_average;  /* exact truncating average, no tables */
+        c->planar = planar_average_kernel ? planar_average_kernel : planes_average;
+        c->strips = split_kernel && planar_average_kernel;
+        return GS_OK;
+    }
+
+    for (int v = 0; v <= 255; v++) {
+        if (curve) {
+            double x = linear ? srgb_to_linear(v / 255.0) : v / 255.0;
+            c->lut_r[v] = (uint32_t)(c->wr * x + 0.5);
+            c->lut_g[v] = (uint32_t)(c->wg * x + 0.5);
+            c->lut_b[v] = (uint32_t)(c->wb * x + 0.5);
+        } else {
+            c->lut_r[v] = c->wr * (uint32_t)v + 32768u;
+            c->lut_g[v] = c->wg * (uint32_t)v;
+            c->lut_b[v] = c->wb * (uint32_t)v;
+        }
+    }
+    if (curve) {
+        for (size_t i = 0; i < sizeof c->tone_curve; i++) {
+            double y = i >= 65536 ? 1.0 : i / 65536.0;
+            if (linear) y = linear_to_srgb(y);
+            if (gamma != 1.0) y = pow(y, 1.0 / gamma);
+            c->tone_curve[i] = (unsigned char)(y * 255.0 + 0.5);
+        }
+    }
+    c->kernel = curve ? gray_lut_curve : gray_lut;
+    if (curve) {
+        c->planar = planes_curve;
+    } else {
+        /* A weight of 65536 (one channel only) does not fit the vector lanes */
+        int fits = c->wr < 65536 && c->wg < 65536 && c->wb < 65536;
+        c->planar = planar_weighted_kernel && fits ? planar_weighted_kernel : planes_weighted;
+        c->strips = split_kernel && planar_weighted_kernel && fits;
+    }
+    return GS_OK;
+}
+
+void gs_convert_row(const struct gs_converter *c, const unsigned char *rgb,
+                    unsigned char *gray, int width) {
+    unsigned char r[GS_STRIP_PIXELS], g[GS_STRIP_PIXELS], b[GS_STRIP_PIXELS];
+
+    if (!c->strips) {
+        c->kernel(c, rgb, gray, width);
+        return;
+    }
+    for (int x = 0, n; x < width; x += n) {
+        n = width - x < GS_STRIP_PIXELS ? width - x : GS_STRIP_PIXELS;
+        split_kernel(rgb + 3 * (size_t)x, n, r, g, b);
+        c->planar(c, r, g, b, gray + x, n);
+    }
+}
+
+void gs_split_planes(const unsigned char *rgb, int width, unsigned char *r, unsigned char *g,
+                     unsigned char *b) {
+    (split_kernel ? split_kernel : split_scalar)(rgb, width, r, g, b);
+}
+
+void gs_convert_planes(const struct gs_converter *c, const unsigned char *r,
+                       const unsigned char *g, const unsigned char *b, unsigned char *gray,
+                       int width) {
+    c->planar(c, r, g, b, gray, width);
+}
+
+void gs_convert_row16(const struct gs_converter *c, const uint16_t *rgb, uint16_t *gray,
+                      int width) {
+    c->kernel16(c, rgb, gray, width);
+}
+
+void gs_scale_row8(const uint16_t *gray, int width, int maxval, unsigned char *out) {
+    uint32_t m = (uint32_t)maxval;
+    for (int x = 0; x < width; x++) out[x] = (unsigned char)((gray[x] * 255u + m / 2) / m);
+}
+
+size_t gs_row_capacity(int format, int width) {
+    switch (format) {
+    case GS_FMT_P6: return (size_t)width * 3;
+    case GS_FMT_P5: return (size_t)width;
+    case GS_FMT_P2: return (size_t)width * (3 + 1) + GS_ROW_SLACK;
+    default:        return (size_t)width * (3 * 3 + 3) + GS_ROW_SLACK;
+    }
+}
+
+uint64_t gs_output_size(int format, int width, int height, const uint64_t hist[256]) {
+    uint64_t size = 0;
+
+    switch (format) {
+    case GS_FMT_P6: return (uint64_t)width * height * 3;
+    case GS_FMT_P5: return (uint64_t)width * height;
+    case GS_FMT_P2:
+        for (int v = 0; v < 256; v++) size += hist[v] * (num_len[v] + 1u);
+        return size;
+    default:
+        for (int v = 0; v < 256; v++) size += hist[v] * pix_len[v];
+        return size;
+    }
+}
+
+size_t gs_encode_header(char *out, size_t cap, int format, int width, int height) {
+    return gs_encode_header_maxval(out, cap, format, width, height, 255);
+}
+
+size_t gs_encode_header_maxval(char *out, size_t cap, int format, int width, int height,
+                               int maxval) {
+    int n = snprintf(out, cap, "%s\n%d %d\n%d\n", format_magic[format], width, height, maxval);
+    return n < 0 || (size_t)n >= cap ? 0 : (size_t)n;
+}
+
+/*
+ * Text rows are built from the fixed-width LUTs: one 4-byte (P2) or
+ * 16-byte (P3) store per pixel, each entry ending in the separator. The
+ * last separator of the row is then turned into the newline, which gives
+ * exactly the "v v v v v v\n" layout of the old per-number copies.
+ *
+ * The span writers are written once and always inlined with a constant
+ * format, so every format gets its own loop with nothing to test per
+ * pixel; span8_kernels picks one per call, indexed by format.
+ */
+typedef size_t (*span8_fn)(const unsigned char *gray, int width, int row_end, char *out);
+
+static inline __attribute__((always_inline))
+size_t format_span8(const unsigned char *gray, int width, int row_end, char *out,
+                    const int format) {
+    size_t pos = 0;  /* Current position in row buffer */
+
+    if (format == GS_FMT_P6) {
+        for (int x = 0; x < width; x++) {
+            out[pos++] = (char)gray[x];
+            out[pos++] = (char)gray[x];
+            out[pos++] = (char)gray[x];
+        }
+        return pos;
+    }
+    if (format == GS_FMT_P5) {
+        memcpy(out, gray, (size_t)width);
+        return (size_t)width;
+    }
+    for (int x = 0; x < width; x++) {
+        if (format == GS_FMT_P2) {
+            memcpy(out + pos, num_text[gray[x]], sizeof num_text[0]);
+            pos += num_len[gray[x]] + 1u;
+        } else {
+            /* Append grayscale triplet to the row buffer */
+            memcpy(out + pos, pix_text[gray[x]], sizeof pix_text[0]);
+            pos += pix_len[gray[x]];
+        }
+    }
+    if (row_end) out[pos - 1] = '\n';
+    return pos;
+}
+
+#define SPAN8_KERNEL(name, format) \
+    static size_t name(const unsigned char *gray, int width, int row_end, char *out) { \
+        return format_span8(gray, width, row_end, out, format); \
+    }
+
+SPAN8_KERNEL(span8_p3, GS_FMT_P3)
+SPAN8_KERNEL(span8_p6, GS_FMT_P6)
+SPAN8_KERNEL(span8_p2, GS_FMT_P2)
+SPAN8_KERNEL(span8_p5, GS_FMT_P5)
+
+static const span8_fn span8_kernels[] = {
+    [GS_FMT_P3] = span8_p3, [GS_FMT_P6] = span8_p6,
+    [GS_FMT_P2] = span8_p2, [GS_FMT_P5] = span8_p5,
+};
+
+size_t gs_format_row(int format, const unsigned char *gray, int width, char *out) {
+    return span8_kernels[format](gray, width, 1, out);
+}
+
+size_t gs_format_span(int format, const unsigned char *gray, int width, int row_end,
+                      char *out) {
+    return span8_kernels[format](gray, width, row_end, out);
+}
+
+size_t gs_row_capacity16(int format, int width) {
+    switch (format) {
+    case GS_FMT_P6: return (size_t)width * 6;
+    case GS_FMT_P5: return (size_t)width * 2;
+    case GS_FMT_P2: return (size_t)width * (5 + 1) + GS_ROW_SLACK;
+    default:        return (size_t)width * (3 * 5 + 3) + GS_ROW_SLACK;
+    }
+}
+
+/*
+ * Text for a 16-bit sample: the 8-bit LUT below 256, else two-digit
+ * pairs from pair_text. Stores up to 5 digits (and may pad the 8-bit ones
+ * to 4 bytes); returns the digit count.
+ */
+static size_t format_u16(char *out, unsigned v) {
+    if (v < 256) {
+        memcpy(out, num_text[v], sizeof num_text[0]);
+        return num_len[v];
+    }
+    unsigned hi = v / 100, lo = v % 100;
+    size_t n;
+    if (hi < 10) {
+        out[0] = (char)('0' + hi);
+        n = 1;
+    } else if (hi < 100) {
+        memcpy(out, pair_text[hi], 2);
+        n = 2;
+    } else {
+        out[0] = (char)('0' + hi / 100);
+        memcpy(out + 1, pair_text[hi % 100], 2);
+        n = 3;
+    }
+    memcpy(out + n, pair_text[lo], 2);
+    return n + 2;
+}
+
+/*
+ * 16-bit span writers, specialized like the 8-bit ones on the format and
+ * on whether maxval needs two bytes per binary sample (wide).
+ */
+typedef size_t (*span16_fn)(const uint16_t *gray, int width, int row_end, char *out);
+
+static inline __attribute__((always_inline))
+size_t format_span16(const uint16_t *gray, int width, int row_end, char *out,
+                     const int format, const int wide) {
+    const int copies = format == GS_FMT_P6 || format == GS_FMT_P3 ? 3 : 1;
+    size_t pos = 0;
+
+    if (format == GS_FMT_P6 || format == GS_FMT_P5) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < copies; c++) {
+                if (wide) out[pos++] = (char)(gray[x] >> 8);
+                out[pos++] = (char)(gray[x] & 0xff);
+            }
+        }
+        return pos;
+    }
+    for (int x = 0; x < width; x++) {
+        for (int c = 0; c < copies; c++) {
+            pos += format_u16(out + pos, gray[x]);
+            out[pos++] = ' ';
+        }
+    }
+    if (row_end) out[pos - 1] = '\n';
+    return pos;
+}
+
+#define SPAN16_KERNEL(name, format, wide) \
+    static size_t name(const uint16_t *gray, int width, int row_end, char *out) { \
+        return format_span16(gray, width, row_end, out, format, wide); \
+    }
+
+SPAN16_KERNEL(span16_p3, GS_FMT_P3, 0)
+SPAN16_KERNEL(span16_p6, GS_FMT_P6, 0)
+SPAN16_KERNEL(span16_p6_wide, GS_FMT_P6, 1)
+SPAN16_KERNEL(span16_p2, GS_FMT_P2, 0)
+SPAN16_KERNEL(span16_p5, GS_FMT_P5, 0)
+SPAN16_KERNEL(span16_p5_wide, GS_FMT_P5, 1)
+
+/* [format][maxval > 255]; text samples print the same either way */
+static const span16_fn span16_kernels[][2] = {
+    [GS_FMT_P3] = { span16_p3, span16_p3 }, [GS_FMT_P6] = { span16_p6, span16_p6_wide },
+    [GS_FMT_P2] = { span16_p2, span16_p2 }, [GS_FMT_P5] = { span16_p5, span16_p5_wide },
+};
+
+size_t gs_format_row16(int format, const uint16_t *gray, int width, int maxval, char *out) {
+    return span16_kernels[format][maxval > 255](gray, width, 1, out);
+}
+
+size_t gs_format_span16(int format, const uint16_t *gray, int width, int maxval, int row_end,
+                        char *out) {
+    return span16_kernels[format][maxval > 255](gray, width, row_end, out);
+}
+
+size_t gs_encode_row(const struct gs_converter *c, int format, const unsigned char *rgb,
+                     int width, unsigned char *gray, char *out) {
+    gs_convert_row(c, rgb, gray, width);
+    return gs_format_row(format, gray, width, out);
+}
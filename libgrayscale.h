@@ -0,0 +1,318 @@
+/*
+ * libgrayscale - PPM (P3/P6) to grayscale conversion as a library.
+ *
+ * The decoder reads a PPM header and then one RGB row at a time from a
+ * FILE* or an in-memory span; the converter and encoder turn RGB rows into
+ * gray P3/P6/P2/P5 rows. The *16 functions do the same for images whose
+ * maxval is not 255, with up to 16 bits per sample. Every buffer is
+ * provided by the caller and all state lives in caller-allocated structs,
+ * so converting an image does not allocate. Call gs_init() once before
+ * anything else.
+ *
+ *     struct gs_decoder d;
+ *     gs_decoder_init_mem(&d, data, len);
+ *     if (gs_read_header(&d) != GS_OK) ...
+ *     out += gs_encode_header(out, cap, GS_FMT_P5, d.width, d.height);
+ *     for (int y = 0; y < d.height; y++) {
+ *         const unsigned char *row;
+ *         if (gs_read_row(&d, rgb, &row) != GS_OK) ...
+ *         out += gs_encode_row(&conv, GS_FMT_P5, row, d.width, gray, out);
+ *     }
+ */
+
+#ifndef LIBGRAYSCALE_H
+#define LIBGRAYSCALE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GS_CHUNK_SIZE (256 * 1024)  /* read chunk of a FILE-backed decoder */
+#define GS_MAX_DIMENSION (1 << 30)    /* per axis; sizes are computed in 64 bits */
+#define GS_MAX_MAXVAL 65535
+#define GS_ROW_SLACK 16             /* bytes a text row store may run past its end */
+
+/* Netpbm formats handled by the converter. */
+enum gs_format {
+    GS_FMT_P3,  /* ASCII RGB */
+    GS_FMT_P6,  /* binary RGB */
+    GS_FMT_P2,  /* ASCII gray, output only */
+    GS_FMT_P5   /* binary gray, output only */
+};
+
+/* Grayscale weightings. */
+enum gs_mode {
+    GS_MODE_AVERAGE,    /* (r + g + b) / 3, the historical default */
+    GS_MODE_BT601,      /* 0.299 R + 0.587 G + 0.114 B */
+    GS_MODE_BT709,      /* 0.2126 R + 0.7152 G + 0.0722 B */
+    GS_MODE_CUSTOM      /* caller-supplied weights */
+};
+
+/* Result codes. The decoder keeps the header values and failing pixel for messages. */
+enum gs_status {
+    GS_OK = 0,
+    GS_ERR_HEADER_EOF,      /* input ends before the magic number */
+    GS_ERR_MAGIC,           /* not a P3 or P6 file */
+    GS_ERR_DIMENSIONS,      /* width/height missing or malformed */
+    GS_ERR_BAD_DIMENSIONS,  /* width/height outside 1..GS_MAX_DIMENSION */
+    GS_ERR_TOO_LARGE,       /* raster larger than the address space */
+    GS_ERR_MAXVAL,          /* maximum color value missing or malformed */
+    GS_ERR_BAD_MAXVAL,      /* maximum color value of 0 */
+    GS_ERR_SEPARATOR,       /* no whitespace byte between P6 header and raster */
+    GS_ERR_PIXEL,           /* pixel data short or malformed at err_row/err_col */
+    GS_ERR_ARG              /* invalid argument */
+};
+
+/*
+ * Chunk supplier for gs_decoder_init_source(): points *chunk at the next
+ * piece of input and returns its length, or 0 at the end. The previous
+ * chunk is no longer referenced once it is called again.
+ */
+typedef size_t (*gs_next_chunk_fn)(void *ctx, const unsigned char **chunk);
+
+/* Byte source of a decoder; private. */
+struct gs_reader {
+    FILE *f;                    /* NULL for a memory span or chunk source */
+    unsigned char *buf;         /* GS_CHUNK_SIZE bytes, FILE sources only */
+    gs_next_chunk_fn next;      /* chunk sources only */
+    void *ctx;
+    const unsigned char *pos;   /* next unread byte */
+    const unsigned char *end;   /* one past the last valid byte */
+    struct gs_counters {        /* kept per chunk and per row; see gs_decoder_counters() */
+        uint64_t bytes_in;      /* bytes read, or the span length */
+        uint64_t read_calls;    /* fread() calls or chunks taken from a source */
+        uint64_t values;        /* pixel-data samples decoded */
+        uint64_t comment_bytes; /* '#' comment bytes skipped, line ends included */
+    } count;
+};
+
+/* Decoder state. The header fields are valid after gs_read_header(). */
+struct gs_decoder {
+    int format;             /* GS_FMT_P3 or GS_FMT_P6 */
+    int width, height, maxval;
+    int row;                /* next row to be read */
+    int col;                /* pixels of that row already read (gs_read_pixels()) */
+    int err_row, err_col;   /* first pixel that could not be read (GS_ERR_PIXEL) */
+    uint64_t *row_offsets;  /* if set, gs_decoder_offset() at the start of each row */
+    int trusted;            /* if set, pixel data is taken as well formed (see below) */
+    struct gs_reader rd;
+};
+
+/*
+ * Converter settings and tables. Without a tone curve a table entry is
+ * weight * value (lut_r also carries the 0.5 rounding term) and the gray
+ * value is the sum >> 16. With a curve an entry is weight * decoded value,
+ * the sum is a 0..65536 light level and tone_curve maps it to the output.
+ */
+struct gs_converter {
+    void (*kernel)(const struct gs_converter *c, const unsigned char *rgb,
+                   unsigned char *gray, int width);
+    void (*kernel16)(const struct gs_converter *c, const uint16_t *rgb,
+                     uint16_t *gray, int width);    /* NULL with a tone curve */
+    void (*planar)(const struct gs_converter *c, const unsigned char *r,
+                   const unsigned char *g, const unsigned char *b, unsigned char *gray,
+                   int width);
+    int strips;             /* gs_convert_row() goes through planes (vectorized) */
+    uint32_t wr, wg, wb;    /* 16.16 fixed point, summing to 65536 */
+    uint32_t lut_r[256], lut_g[256], lut_b[256];
+    unsigned char tone_curve[65536 + 4];    /* the sum can round up by a few units */
+};
+
+/* gs_init() flags */
+#define GS_INIT_NO_SIMD 1   /* use the scalar P3 tokenizer and conversion kernels only */
+
+/* Pixels per strip of planes in gs_convert_row(); three planes fit in L1 */
+#define GS_STRIP_PIXELS 2048
+
+/*
+ * Picks the P3 tokenizer and the conversion kernels for this CPU.
+ * Not thread-safe; call it once before any other function.
+ */
+void gs_init(int flags);
+
+/*
+ * Sets up a converter. weights (R, G, B; normalized to sum to 1) are read
+ * for GS_MODE_CUSTOM only. linear mixes the channels in linear light (sRGB
+ * decode, weight, sRGB encode); gamma != 1 applies the output tone curve
+ * v^(1/gamma). Tables the settings do not use are zeroed, so converters
+ * set up alike are equal byte for byte from wr on. Returns GS_ERR_ARG for
+ * negative or all-zero weights.
+ */
+int gs_converter_init(struct gs_converter *c, int mode, const double weights[3],
+                      int linear, double gamma);
+
+/* Attaches a decoder to f; chunk is a caller-owned GS_CHUNK_SIZE read buffer. */
+void gs_decoder_init_file(struct gs_decoder *d, FILE *f, unsigned char *chunk);
+
+/* Attaches a decoder to a whole image in memory, which must outlive it. */
+void gs_decoder_init_mem(struct gs_decoder *d, const void *data, size_t len);
+
+/* Attaches a decoder to a chunk supplier (e.g. a network or pipeline queue); no copies. */
+void gs_decoder_init_source(struct gs_decoder *d, gs_next_chunk_fn next, void *ctx);
+
+/*
+ * Bytes consumed since the decoder was attached. Taken at the start of a
+ * row it is a point where decoding can resume (see gs_decoder_resume());
+ * set d->row_offsets to a height-entry array to have every row's recorded.
+ */
+uint64_t gs_decoder_offset(const struct gs_decoder *d);
+
+/*
+ * Takes the header from elsewhere (e.g. an index) instead of
+ * gs_read_header(), for a decoder attached at the start of row row.
+ */
+void gs_decoder_resume(struct gs_decoder *d, int format, int width, int height, int maxval,
+                       int row);
+
+/* Copies the decoder's running I/O and token counters to *out. */
+void gs_decoder_counters(const struct gs_decoder *d, struct gs_counters *out);
+
+/* Reads and validates the header. Returns GS_OK or a GS_ERR_* code. */
+int gs_read_header(struct gs_decoder *d);
+
+/*
+ * Decodes the next row into rgb (3 * width bytes). If row is not NULL it
+ * is pointed at the decoded row, which for P6 in memory is the raster
+ * itself and rgb is left untouched. Returns GS_OK or GS_ERR_PIXEL, and
+ * GS_ERR_ARG unless maxval is 255 (see gs_read_row16()).
+ */
+int gs_read_row(struct gs_decoder *d, unsigned char *rgb, const unsigned char **row);
+
+/*
+ * With d->trusted set (after gs_read_header()), the row functions take the
+ * pixel data as well formed: in P3 any non-digit byte separates values
+ * ('#' starts no comment) and values are not range-checked, and binary
+ * samples are not checked against maxval. Out-of-range input then gives
+ * wrong pixels but never touches memory outside the buffers; only a short
+ * input is still reported.
+ */
+
+/*
+ * Decodes the next n pixels of the current row, for rows too wide to be
+ * held whole; gs_read_row() reads the rest of the row. The same rules as
+ * gs_read_row() apply otherwise. Returns GS_ERR_ARG if n runs past the end
+ * of the row.
+ */
+int gs_read_pixels(struct gs_decoder *d, unsigned char *rgb, int n, const unsigned char **row);
+
+/*
+ * Decodes the next row of an image with any maxval into 3 * width
+ * samples; P6 samples are big-endian pairs of bytes when maxval > 255.
+ * Samples above maxval are rejected. Returns GS_OK or GS_ERR_PIXEL.
+ */
+int gs_read_row16(struct gs_decoder *d, uint16_t *rgb);
+
+/* gs_read_pixels() for gs_read_row16(). */
+int gs_read_pixels16(struct gs_decoder *d, uint16_t *rgb, int n);
+
+/*
+ * Skips the next n rows. P3 values are passed over without being
+ * converted or checked. Returns GS_OK, or GS_ERR_PIXEL if the input ends;
+ * maxval 255 only, as gs_read_row().
+ */
+int gs_skip_rows(struct gs_decoder *d, int n);
+
+/*
+ * gs_read_row() for columns x .. x + w - 1 only: rgb holds 3 * w bytes,
+ * and the rest of the row is skipped as in gs_skip_rows(). err_col counts
+ * from the start of the row. Returns GS_ERR_ARG if the window does not fit.
+ */
+int gs_read_row_part(struct gs_decoder *d, int x, int w, unsigned char *rgb,
+                     const unsigned char **row);
+
+/*
+ * Bytes the decoder holds but has not consumed: the rest of the span for
+ * a memory decoder, the rest of the current chunk otherwise.
+ */
+const unsigned char *gs_decoder_pending(const struct gs_decoder *d, size_t *len);
+
+/*
+ * Parses up to n P3 channel values from a span into dst, with the same
+ * rules as gs_read_row() (the trusted ones if trusted is set). Returns the
+ * number stored; if short of n, *status is 0 for a malformed or
+ * out-of-range value and -1 if the span ran out.
+ */
+size_t gs_parse_values(const unsigned char *data, size_t len, unsigned char *dst,
+                       size_t n, int trusted, int *status);
+
+/* Converts one RGB row into width gray samples. */
+void gs_convert_row(const struct gs_converter *c, const unsigned char *rgb,
+                    unsigned char *gray, int width);
+
+/*
+ * The two stages of gs_convert_row() on its fast path, for callers that
+ * keep pixels as separate R, G and B planes: splitting width interleaved
+ * pixels into planes, and converting planes into width gray samples.
+ */
+void gs_split_planes(const unsigned char *rgb, int width, unsigned char *r, unsigned char *g,
+                     unsigned char *b);
+void gs_convert_planes(const struct gs_converter *c, const unsigned char *r,
+                       const unsigned char *g, const unsigned char *b, unsigned char *gray,
+                       int width);
+
+/*
+ * gs_convert_row() on 16-bit samples, which keep their maxval. Needs
+ * c->kernel16, i.e. a converter without linear light or a gamma.
+ */
+void gs_convert_row16(const struct gs_converter *c, const uint16_t *rgb, uint16_t *gray,
+                      int width);
+
+/* Rescales width gray samples from 0..maxval to 0..255, rounded. */
+void gs_scale_row8(const uint16_t *gray, int width, int maxval, unsigned char *out);
+
+/* Upper bound on one encoded row in format, store overrun included. */
+size_t gs_row_capacity(int format, int width);
+
+/*
+ * Exact encoded size of height rows in format whose gray samples have the
+ * histogram hist, header excluded. Text rows are sized without the store
+ * overrun of gs_format_row().
+ */
+uint64_t gs_output_size(int format, int width, int height, const uint64_t hist[256]);
+
+/* Writes the output header for a maxval-255 image. Returns its length, 0 if cap is too small. */
+size_t gs_encode_header(char *out, size_t cap, int format, int width, int height);
+
+/* gs_encode_header() with the given maxval. */
+size_t gs_encode_header_maxval(char *out, size_t cap, int format, int width, int height,
+                               int maxval);
+
+/* Encodes a row of gray samples. Returns the number of bytes stored in out. */
+size_t gs_format_row(int format, const unsigned char *gray, int width, char *out);
+
+/*
+ * Encodes part of a row. A text row's last separator becomes the newline
+ * only when row_end is set, so the parts together match gs_format_row().
+ */
+size_t gs_format_span(int format, const unsigned char *gray, int width, int row_end,
+                      char *out);
+
+/* Upper bound on one row of gs_format_row16(). */
+size_t gs_row_capacity16(int format, int width);
+
+/*
+ * Encodes a row of gray samples of the given maxval: two big-endian bytes
+ * per binary sample above 255, up to five digits per text sample.
+ */
+size_t gs_format_row16(int format, const uint16_t *gray, int width, int maxval, char *out);
+
+/* gs_format_span() for gs_format_row16(). */
+size_t gs_format_span16(int format, const uint16_t *gray, int width, int maxval, int row_end,
+                        char *out);
+
+/*
+ * Converts one RGB row (gray is a width-byte scratch row) and encodes it
+ * into out, which must hold gs_row_capacity() bytes. Returns the length.
+ */
+size_t gs_encode_row(const struct gs_converter *c, int format, const unsigned char *rgb,
+                     int width, unsigned char *gray, char *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBGRAYSCALE_H */
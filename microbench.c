@@ -0,0 +1,463 @@
+#if defined(__linux__)
+#define _DEFAULT_SOURCE  /* clock_gettime() under -std=c11 */
+#endif
+
+/*
+ * Per-stage microbenchmarks of libgrayscale (run with "make microbench").
+ * Each stage runs in process on the same synthetic image a number of
+ * times, and the median run is kept, as nanoseconds per pixel (per
+ * header for the header stage). Unlike bench.c there is no process
+ * startup or file I/O in the numbers, so a change to one stage shows up
+ * on its own. --save stores the results as a baseline, with the host and
+ * CPU they were measured on; --compare reports them against one and
+ * fails if a stage got slower than the threshold and the floor allow, so
+ * the target can gate a CI job on the machine that saved the baseline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/utsname.h>
+#endif
+
+#include "libgrayscale.h"
+
+#define MAX_REPS 1000
+#define HEADER_LOOPS 20000      /* headers parsed per run of the header stage */
+#define OUT_BUFFER (256 * 1024) /* stdio buffer of the fwrite stage, as in the converter */
+#define HOST_MAX 256
+
+/* Stages, in pipeline order. */
+enum {
+    STAGE_HEADER,           /* gs_read_header() on a P3 header with a comment */
+    STAGE_TOKENIZE,         /* gs_parse_values() on the P3 raster */
+    STAGE_TOKENIZE_TRUSTED, /* the same with the --trusted rules */
+    STAGE_CONVERT,          /* gs_convert_row(), average weighting */
+    STAGE_FORMAT_P3,        /* gs_format_row() to ASCII RGB */
+    STAGE_FORMAT_P2,        /* gs_format_row() to ASCII gray */
+    STAGE_FWRITE,           /* the P3 rows through a buffered FILE to /dev/null */
+    STAGE_COUNT
+};
+
+static const char *const stage_names[] = {
+    "header", "tokenize", "tokenize-trusted", "convert", "format-p3", "format-p2", "fwrite"
+};
+
+/* The synthetic image in each form the stages take as input. */
+struct bench_data {
+    int width, height;
+    char *text;                 /* P3 raster: single spaces, one row per line */
+    size_t text_len;
+    unsigned char *rgb;         /* the same pixels, decoded */
+    unsigned char *gray;        /* their gray values */
+    char *row;                  /* one encoded row */
+    char *rows;                 /* every P3 row, encoded back to back */
+    size_t *row_end;            /* end of row y in rows */
+    FILE *sink;                 /* /dev/null, with an OUT_BUFFER buffer */
+    char *sink_buf;
+    struct gs_converter conv;
+};
+
+/* xorshift64*, as in bench.c: the same image for the same seed everywhere. */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static unsigned rng_byte(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned)((rng_state * 0x2545f4914f6cdd1dull) >> 56);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Builds every input of the stages. Returns 0 if out of memory. */
+static int bench_data_init(struct bench_data *d, int width, int height) {
+    size_t pixels = (size_t)width * height, cap = gs_row_capacity(GS_FMT_P3, width);
+    char *p;
+
+    memset(d, 0, sizeof *d);
+    d->width = width;
+    d->height = height;
+    d->text = malloc(pixels * 12 + (size_t)height + 1);
+    d->rgb = malloc(pixels * 3);
+    d->gray = malloc(pixels);
+    d->row = malloc(cap);
+    d->rows = malloc(cap * (size_t)height);
+    d->row_end = malloc((size_t)height * sizeof *d->row_end);
+    d->sink_buf = malloc(OUT_BUFFER);
+    d->sink = fopen("/dev/null", "wb");
+    if (!d->text || !d->rgb || !d->gray || !d->row || !d->rows || !d->row_end ||
+        !d->sink_buf || !d->sink) {
+        return 0;
+    }
+    setvbuf(d->sink, d->sink_buf, _IOFBF, OUT_BUFFER);
+    gs_converter_init(&d->conv, GS_MODE_AVERAGE, NULL, 0, 1.0);
+
+    p = d->text;
+    for (size_t i = 0; i < pixels * 3; i++) {
+        unsigned v = rng_byte();
+        d->rgb[i] = (unsigned char)v;
+        if (v >= 100) *p++ = (char)('0' + v / 100);
+        if (v >= 10) *p++ = (char)('0' + v / 10 % 10);
+        *p++ = (char)('0' + v % 10);
+        *p++ = (i + 1) % ((size_t)width * 3) == 0 ? '\n' : ' ';
+    }
+    d->text_len = (size_t)(p - d->text);
+
+    size_t len = 0;
+    for (int y = 0; y < height; y++) {
+        gs_convert_row(&d->conv, d->rgb + (size_t)y * width * 3, d->gray + (size_t)y * width,
+                       width);
+        len += gs_format_row(GS_FMT_P3, d->gray + (size_t)y * width, width, d->rows + len);
+        d->row_end[y] = len;
+    }
+    return 1;
+}
+
+static void bench_data_free(struct bench_data *d) {
+    if (d->sink) fclose(d->sink);
+    free(d->sink_buf);
+    free(d->row_end);
+    free(d->rows);
+    free(d->row);
+    free(d->gray);
+    free(d->rgb);
+    free(d->text);
+}
+
+static volatile uint64_t sink_value;   /* keeps results alive */
+
+/*
+ * Runs stage once. Stores the operations done (pixels, or headers) and
+ * the bytes that went through the stage, and returns the time taken, or
+ * -1 if the stage failed.
+ */
+static double run_stage(int stage, struct bench_data *d, uint64_t *ops, uint64_t *bytes) {
+    static const char header[] = "P3\n# synthetic minimal image\n1920 1080\n255\n0 0 0\n";
+    int width = d->width, height = d->height;
+    uint64_t sum = 0;
+    double t0 = now_seconds();
+
+    *ops = (uint64_t)width * height;
+    switch (stage) {
+    case STAGE_HEADER:
+        for (int i = 0; i < HEADER_LOOPS; i++) {
+            struct gs_decoder dec;
+            gs_decoder_init_mem(&dec, header, sizeof header - 1);
+            if (gs_read_header(&dec) != GS_OK) return -1;
+            sum += (uint64_t)dec.width;
+        }
+        *ops = HEADER_LOOPS;
+        *bytes = (uint64_t)HEADER_LOOPS * (sizeof header - 7);
+        break;
+    case STAGE_TOKENIZE:
+    case STAGE_TOKENIZE_TRUSTED: {
+        size_t n = (size_t)width * height * 3;
+        int status;
+        if (gs_parse_values((const unsigned char *)d->text, d->text_len, d->rgb, n,
+                            stage == STAGE_TOKENIZE_TRUSTED, &status) != n) {
+            return -1;
+        }
+        sum += d->rgb[n - 1];
+        *bytes = d->text_len;
+        break;
+    }
+    case STAGE_CONVERT:
+        for (int y = 0; y < height; y++) {
+            gs_convert_row(&d->conv, d->rgb + (size_t)y * width * 3,
+                           d->gray + (size_t)y * width, width);
+        }
+        sum += d->gray[(size_t)width * height - 1];
+        *bytes = (uint64_t)width * height * 3;
+        break;
+    case STAGE_FORMAT_P3:
+    case STAGE_FORMAT_P2: {
+        int format = stage == STAGE_FORMAT_P3 ? GS_FMT_P3 : GS_FMT_P2;
+        for (int y = 0; y < height; y++) {
+            sum += gs_format_row(format, d->gray + (size_t)y * width, width, d->row);
+        }
+        *bytes = sum;
+        break;
+    }
+    case STAGE_FWRITE:
+        for (int y = 0; y < height; y++) {
+            size_t start = y ? d->row_end[y - 1] : 0, len = d->row_end[y] - start;
+            if (fwrite(d->rows + start, 1, len, d->sink) != len) return -1;
+        }
+        if (fflush(d->sink) != 0) return -1;
+        sum = *bytes = d->row_end[height - 1];
+        break;
+    }
+    double t = now_seconds() - t0;
+    sink_value += sum;
+    return t;
+}
+
+/*
+ * Describes the machine as "NODE, ARCH, CPU", as far as the platform
+ * tells: the CPU model comes from /proc/cpuinfo on Linux only.
+ */
+static void host_describe(char *buf, size_t size) {
+    char cpu[HOST_MAX] = "unknown CPU";
+#ifdef __linux__
+    char line[HOST_MAX];
+    FILE *f = fopen("/proc/cpuinfo", "r");
+
+    while (f && fgets(line, sizeof line, f)) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon && colon[1] == ' ') {
+            snprintf(cpu, sizeof cpu, "%s", colon + 2);
+            cpu[strcspn(cpu, "\n")] = '\0';
+            break;
+        }
+    }
+    if (f) fclose(f);
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    struct utsname u;
+    if (uname(&u) == 0) {
+        snprintf(buf, size, "%.64s, %.32s, %s", u.nodename, u.machine, cpu);
+        return;
+    }
+#endif
+    snprintf(buf, size, "%s", cpu);
+}
+
+/* A baseline: stage names and their ns/op, and the host they come from. */
+struct baseline {
+    char name[STAGE_COUNT][32];
+    double ns[STAGE_COUNT];
+    int count;
+    char host[HOST_MAX];        /* empty if the file names none */
+};
+
+/*
+ * Reads "STAGE NS" lines ('#' lines are comments, "# host: ..." names the
+ * machine). Returns 0 if the file cannot be read.
+ */
+static int baseline_load(const char *path, struct baseline *b) {
+    char line[HOST_MAX + 8];    /* room for "# host: " and a whole host */
+    FILE *f = fopen(path, "r");
+
+    memset(b, 0, sizeof *b);
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof line, f) && b->count < STAGE_COUNT) {
+        if (strncmp(line, "# host: ", 8) == 0) {
+            snprintf(b->host, sizeof b->host, "%s", line + 8);
+            b->host[strcspn(b->host, "\n")] = '\0';
+        }
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%31s %lf", b->name[b->count], &b->ns[b->count]) == 2 &&
+            b->ns[b->count] > 0) {
+            b->count++;
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+/* The baseline ns/op of stage name, or 0 if it has none. */
+static double baseline_find(const struct baseline *b, const char *name) {
+    for (int i = 0; i < b->count; i++) {
+        if (strcmp(b->name[i], name) == 0) return b->ns[i];
+    }
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* The median of the n values in v, which are sorted in place. */
+static double median(double *v, int n) {
+    qsort(v, (size_t)n, sizeof *v, compare_doubles);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Turns a comma-separated list of names into a bitmask. Returns 0 if one is unknown. */
+static unsigned parse_names(const char *list, const char *const *names, int count) {
+    unsigned mask = 0;
+    char buf[256];
+
+    snprintf(buf, sizeof buf, "%s", list);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        int i = 0;
+        while (i < count && strcmp(tok, names[i]) != 0) i++;
+        if (i == count) return 0;
+        mask |= 1u << i;
+    }
+    return mask;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s WxH] [-n RUNS] [--stages LIST] [--no-simd] [--seed N]\n"
+            "          [--save FILE] [--compare FILE [--threshold PCT] [--floor NS]]\n"
+            "  -s WxH           image size (default 1920x1080)\n"
+            "  -n RUNS          runs per stage, the median counts (default 15)\n"
+            "  --stages LIST    header,tokenize,tokenize-trusted,convert,format-p3,\n"
+            "                   format-p2,fwrite (default all)\n"
+            "  --no-simd        use the scalar tokenizer and conversion kernels only\n"
+            "  --save FILE      write the results to FILE as a baseline\n"
+            "  --compare FILE   compare with the baseline in FILE and exit non-zero if\n"
+            "                   a stage is slower by more than the threshold and the floor\n"
+            "  --threshold PCT  allowed slowdown per stage (default 10)\n"
+            "  --floor NS       allowed slowdown per stage in ns/op, whatever the\n"
+            "                   percentage (default 0.25)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    int width = 1920, height = 1080, runs = 15, use_simd = 1;
+    unsigned stage_mask = (1u << STAGE_COUNT) - 1;
+    const char *save_to = NULL, *compare_with = NULL;
+    double threshold = 10, floor_ns = 0.25;
+    static double times[STAGE_COUNT][MAX_REPS];
+    double mid[STAGE_COUNT];
+    char host[HOST_MAX];
+    int broken[STAGE_COUNT] = { 0 };    /* a run of the stage failed */
+    uint64_t ops[STAGE_COUNT], bytes[STAGE_COUNT];
+    struct baseline base;
+    struct bench_data d;
+    int failed = 0, slower = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--no-simd") == 0) {
+            use_simd = 0;
+            continue;
+        }
+        if (strcmp(arg, "-s") == 0 && val) {
+            if (sscanf(val, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0 ||
+                (uint64_t)width * height > (1u << 26)) {
+                fprintf(stderr, "Error: Size must be WIDTHxHEIGHT, at most 64 Mpixel\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "-n") == 0 && val) {
+            runs = atoi(val);
+            if (runs < 1 || runs > MAX_REPS) {
+                fprintf(stderr, "Error: Runs must be 1-%d\n", MAX_REPS);
+                return 1;
+            }
+        } else if (strcmp(arg, "--stages") == 0 && val) {
+            if ((stage_mask = parse_names(val, stage_names, STAGE_COUNT)) == 0) {
+                fprintf(stderr, "Error: Unknown stage in '%s'\n", val);
+                return 1;
+            }
+        } else if (strcmp(arg, "--seed") == 0 && val) {
+            rng_state = strtoull(val, NULL, 0) | 1;
+        } else if (strcmp(arg, "--save") == 0 && val) {
+            save_to = val;
+        } else if (strcmp(arg, "--compare") == 0 && val) {
+            compare_with = val;
+        } else if (strcmp(arg, "--threshold") == 0 && val) {
+            threshold = atof(val);
+            if (!(threshold > 0)) {
+                fprintf(stderr, "Error: Threshold must be a positive percentage\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--floor") == 0 && val) {
+            floor_ns = atof(val);
+            if (!(floor_ns >= 0)) {
+                fprintf(stderr, "Error: Floor must be a non-negative number of ns\n");
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (compare_with && !baseline_load(compare_with, &base)) {
+        fprintf(stderr, "Error: Cannot read baseline '%s'\n", compare_with);
+        return 1;
+    }
+    gs_init(use_simd ? 0 : GS_INIT_NO_SIMD);
+    if (!bench_data_init(&d, width, height)) {
+        fprintf(stderr, "Error: Cannot allocate %dx%d benchmark data\n", width, height);
+        bench_data_free(&d);
+        return 1;
+    }
+
+    host_describe(host, sizeof host);
+    printf("%dx%d, median of %d runs%s\n", width, height, runs, use_simd ? "" : ", no SIMD");
+    if (compare_with && base.host[0] && strcmp(base.host, host) != 0) {
+        printf("Note: the baseline was measured on %s, this is %s\n", base.host, host);
+    }
+    printf("%-17s %9s %9s", "stage", "ns/op", "MB/s");
+    if (compare_with) printf(" %9s %8s", "baseline", "change");
+    printf("\n");
+    /* Stages take turns, so a slow spell of the machine hits all of them alike */
+    for (int r = 0; r <= runs; r++) {  /* run 0 warms the caches up */
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            if (!(stage_mask & (1u << s)) || broken[s]) continue;
+            double t = run_stage(s, &d, &ops[s], &bytes[s]);
+            if (t < 0) broken[s] = 1;
+            else if (r > 0) times[s][r - 1] = t;
+        }
+    }
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        if (!(stage_mask & (1u << s))) continue;
+        if (broken[s]) {
+            printf("%-17s   failed\n", stage_names[s]);
+            failed = 1;
+            stage_mask &= ~(1u << s);
+            continue;
+        }
+        mid[s] = median(times[s], runs);
+        double ns = mid[s] * 1e9 / (double)ops[s];
+        printf("%-17s %9.3f %9.1f", stage_names[s], ns, (double)bytes[s] / mid[s] / 1e6);
+        if (compare_with) {
+            double was = baseline_find(&base, stage_names[s]);
+            if (was > 0) {
+                /* Sub-ns stages move by more than 10% on noise alone, hence the floor */
+                double change = (ns / was - 1) * 100;
+                int regressed = change > threshold && ns - was > floor_ns;
+                printf(" %9.3f %+7.1f%%%s", was, change, regressed ? "  SLOWER" : "");
+                slower += regressed;
+            } else {
+                printf(" %9s %8s", "-", "new");
+            }
+        }
+        printf("\n");
+    }
+
+    if (save_to) {
+        FILE *f = fopen(save_to, "w");
+        int ok = f != NULL;
+        if (ok) {
+            fprintf(f, "# grayscale-microbench baseline: %dx%d, median of %d runs%s\n",
+                    width, height, runs, use_simd ? "" : ", no SIMD");
+            fprintf(f, "# host: %s\n", host);
+#ifdef __VERSION__
+            fprintf(f, "# compiler: cc %s\n", __VERSION__);
+#endif
+            fprintf(f, "# stage ns/op\n");
+            for (int s = 0; s < STAGE_COUNT; s++) {
+                if (stage_mask & (1u << s)) {
+                    fprintf(f, "%s %.3f\n", stage_names[s], mid[s] * 1e9 / (double)ops[s]);
+                }
+            }
+            if (fclose(f) != 0) ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: Cannot write baseline '%s'\n", save_to);
+            failed = 1;
+        }
+    }
+    if (compare_with) {
+        printf("%d stage%s slower than the baseline by more than %g%% and %g ns/op\n", slower,
+               slower == 1 ? "" : "s", threshold, floor_ns);
+    }
+    bench_data_free(&d);
+    return failed || slower;
+}